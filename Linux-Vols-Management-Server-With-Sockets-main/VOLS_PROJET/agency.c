@@ -4,13 +4,55 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
 #include <sys/socket.h>
+#include <sys/random.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
 #define MAX_RESPONSE 8192
+#define MAX_DATAGRAM 65536
+#define UDP_ATTEMPTS 5       // Sends of one UDP request before giving up
+#define UDP_TIMEOUT_MS 200   // First wait for the reply, doubled at each resend
 
+// Benchmark operations, in the order of the -m mix
+enum { BENCH_RESERVE, BENCH_CANCEL, BENCH_INVOICE, BENCH_CONSULT, BENCH_OPS };
+const char* bench_op_names[BENCH_OPS] = {"RESERVE", "CANCEL", "INVOICE", "CONSULT"};
 
+// Benchmark settings, shared read-only by the simulated agencies
+typedef struct {
+    int tcp;
+    int agencies;
+    int duration;     // Seconds
+    double rate;      // Total requests per second, 0 for closed loop
+    int mix[BENCH_OPS]; // Percentages
+    int* refs;
+    int num_refs;
+    int seats;
+    int first_agency;
+    struct sockaddr_in server_addr;
+    struct timespec start;
+} BenchConfig;
+
+// What one simulated agency measured
+typedef struct {
+    int index;
+    Histogram latency[BENCH_OPS];
+    uint64_t succeeded;
+    uint64_t failed;  // Server answered, but refused (FAILURE, INVALID...)
+    uint64_t busy;    // Turned away by admission control (BUSY)
+    uint64_t errors;  // Timeouts and connection errors
+} BenchAgency;
+
+BenchConfig bench;
+
+// UDP requests are sent as "#<agency>:<id> COMMAND": the server answers with
+// the same prefix and replays its cached reply when the request is resent,
+// so a lost reply never books or cancels twice.
+int udp_agency_id;
+uint32_t udp_next_id;
 
 // Function to send a request and receive a response
 void send_request(int sock, char* protocol, char* request, char* response, int response_size, struct sockaddr_in* server_addr) {
@@ -26,27 +68,541 @@ void send_request(int sock, char* protocol, char* request, char* response, int r
             strcpy(response, "Erreur de réception");
         }
     } else { // udp
-        if (sendto(sock, request, strlen(request), 0, (struct sockaddr*)server_addr, sizeof(*server_addr)) < 0) {
-            strcpy(response, "Erreur d'envoi");
+        char datagram[320], prefix[32];
+        int prefix_len = snprintf(prefix, sizeof(prefix), "#%d:%u ", udp_agency_id, udp_next_id++);
+        snprintf(datagram, sizeof(datagram), "%s%s", prefix, request);
+        int timeout_ms = UDP_TIMEOUT_MS;
+        for (int attempt = 0; attempt < UDP_ATTEMPTS; attempt++, timeout_ms *= 2) {
+            if (sendto(sock, datagram, strlen(datagram), 0, (struct sockaddr*)server_addr, sizeof(*server_addr)) < 0) {
+                strcpy(response, "Erreur d'envoi");
+                return;
+            }
+            struct timeval timeout = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+            setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            int bytes;
+            // Skip late replies to earlier requests until ours or the timeout
+            while ((bytes = recvfrom(sock, response, response_size - 1, 0, NULL, NULL)) > 0) {
+                response[bytes] = '\0';
+                if (bytes >= prefix_len && memcmp(response, prefix, prefix_len) == 0) {
+                    memmove(response, response + prefix_len, bytes - prefix_len + 1);
+                    return;
+                }
+            }
+            if (bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK) break;
+        }
+        strcpy(response, "Erreur de réception");
+    }
+}
+
+// Send the whole buffer (TCP)
+int send_all(int sock, const unsigned char* data, size_t len) {
+    while (len > 0) {
+        ssize_t sent = send(sock, data, len, 0);
+        if (sent <= 0) return -1;
+        data += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+// Receive exactly len bytes (TCP)
+int recv_all(int sock, unsigned char* data, size_t len) {
+    while (len > 0) {
+        ssize_t bytes = recv(sock, data, len, 0);
+        if (bytes <= 0) return -1;
+        data += bytes;
+        len -= bytes;
+    }
+    return 0;
+}
+
+// Book `count` times `seats` seats on a flight using the framed protocol:
+// every request is sent back-to-back, then the replies are read and matched
+// by request id, so the whole batch costs a single round trip.
+void pipeline_reserve(int sock, int agency_id, int ref, int seats, int count) {
+    size_t frame_size = FRAME_HEADER_SIZE + 12;
+    unsigned char* requests = malloc(frame_size * count);
+    if (!requests) {
+        perror("Erreur d'allocation");
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        unsigned char* p = requests + i * frame_size;
+        encode_frame_header(p, OP_RESERVE, 0, i, 12);
+        put_u32(p + FRAME_HEADER_SIZE, ref);
+        put_u32(p + FRAME_HEADER_SIZE + 4, agency_id);
+        put_u32(p + FRAME_HEADER_SIZE + 8, seats);
+    }
+    if (send_all(sock, requests, frame_size * count) < 0) {
+        printf("Erreur d'envoi\n");
+        free(requests);
+        return;
+    }
+    free(requests);
+
+    int succeeded = 0, failed = 0;
+    for (int i = 0; i < count; i++) {
+        unsigned char header[FRAME_HEADER_SIZE];
+        unsigned char payload[256];
+        int opcode, status;
+        uint32_t request_id, length;
+        if (recv_all(sock, header, sizeof(header)) < 0 || header[0] != FRAME_MAGIC) {
+            printf("Erreur de réception\n");
             return;
         }
-        socklen_t addr_len = sizeof(*server_addr);
-        int bytes = recvfrom(sock, response, response_size - 1, 0, (struct sockaddr*)server_addr, &addr_len);
-        if (bytes > 0) {
-            response[bytes] = '\0';
+        decode_frame_header(header, &opcode, &status, &request_id, &length);
+        if (length > sizeof(payload) || recv_all(sock, payload, length) < 0) {
+            printf("Erreur de réception\n");
+            return;
+        }
+        if (status == ST_SUCCESS) {
+            succeeded++;
         } else {
-            strcpy(response, "Erreur de réception");
+            failed++;
+            printf("Requête %u: échec (statut %d)\n", request_id, status);
+        }
+    }
+    printf("%d réservations réussies, %d refusées\n", succeeded, failed);
+}
+
+uint64_t elapsed_us(const struct timespec* from, const struct timespec* to) {
+    return (to->tv_sec - from->tv_sec) * 1000000ULL + (to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+void timespec_add_ns(struct timespec* t, uint64_t ns) {
+    ns += t->tv_nsec;
+    t->tv_sec += ns / 1000000000ULL;
+    t->tv_nsec = ns % 1000000000ULL;
+}
+
+int timespec_before(const struct timespec* a, const struct timespec* b) {
+    return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+int bench_connect() {
+    int sock = socket(AF_INET, bench.tcp ? SOCK_STREAM : SOCK_DGRAM, 0);
+    if (sock < 0) return -1;
+    // A connected UDP socket only receives the server's datagrams
+    if (connect(sock, (struct sockaddr*)&bench.server_addr, sizeof(bench.server_addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    if (!bench.tcp) {
+        struct timeval timeout = {1, 0}; // A lost datagram counts as an error
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    }
+    return sock;
+}
+
+// Read one reply frame; its payload is kept in *payload (grown as needed).
+// Returns the status, or -1 if the connection failed.
+int recv_frame(int sock, unsigned char** payload, size_t* capacity, uint32_t* length) {
+    unsigned char header[FRAME_HEADER_SIZE];
+    int opcode, status;
+    uint32_t request_id;
+    if (recv_all(sock, header, sizeof(header)) < 0 || header[0] != FRAME_MAGIC) return -1;
+    decode_frame_header(header, &opcode, &status, &request_id, length);
+    if (*length > *capacity) {
+        unsigned char* bigger = realloc(*payload, *length);
+        if (!bigger) return -1;
+        *payload = bigger;
+        *capacity = *length;
+    }
+    if (recv_all(sock, *payload, *length) < 0) return -1;
+    return status;
+}
+
+// Send one request and wait for its reply. Returns ST_SUCCESS, another
+// ST_* status if the server refused it, or -1 on timeout/connection error.
+int bench_request(int sock, int op, int agency_id, int ref,
+                  unsigned char** payload, size_t* capacity) {
+    if (bench.tcp) {
+        static const int opcodes[BENCH_OPS] = {OP_RESERVE, OP_CANCEL, OP_INVOICE, OP_CONSULT};
+        unsigned char request[FRAME_HEADER_SIZE + 12];
+        uint32_t length = 0;
+        if (op == BENCH_RESERVE || op == BENCH_CANCEL) {
+            put_u32(request + FRAME_HEADER_SIZE, ref);
+            put_u32(request + FRAME_HEADER_SIZE + 4, agency_id);
+            put_u32(request + FRAME_HEADER_SIZE + 8, bench.seats);
+            length = 12;
+        } else if (op == BENCH_INVOICE) {
+            put_u32(request + FRAME_HEADER_SIZE, agency_id);
+            length = 4;
         }
+        encode_frame_header(request, opcodes[op], 0, 0, length);
+        if (send_all(sock, request, FRAME_HEADER_SIZE + length) < 0) return -1;
+        return recv_frame(sock, payload, capacity, &length);
+    }
+
+    char request[64];
+    if (op == BENCH_RESERVE) {
+        snprintf(request, sizeof(request), "RESERVE %d %d %d", ref, agency_id, bench.seats);
+    } else if (op == BENCH_CANCEL) {
+        snprintf(request, sizeof(request), "CANCEL %d %d %d", ref, agency_id, bench.seats);
+    } else if (op == BENCH_INVOICE) {
+        snprintf(request, sizeof(request), "INVOICE %d", agency_id);
+    } else {
+        snprintf(request, sizeof(request), "CONSULT");
+    }
+    if (send(sock, request, strlen(request), 0) < 0) return -1;
+    ssize_t bytes = recv(sock, *payload, *capacity - 1, 0);
+    if (bytes < 0) return -1;
+    (*payload)[bytes] = '\0';
+    if (strcmp((char*)*payload, "FAILURE") == 0) return ST_FAILURE;
+    if (strcmp((char*)*payload, "INVALID_COMMAND") == 0) return ST_INVALID;
+    if (strcmp((char*)*payload, "SERVER_ERROR") == 0) return ST_SERVER_ERROR;
+    if (strcmp((char*)*payload, "BUSY") == 0) return ST_BUSY;
+    if (strcmp((char*)*payload, "READ_ONLY") == 0) return ST_READ_ONLY;
+    return ST_SUCCESS;
+}
+
+// One simulated agency: closed loop (next request as soon as the reply
+// arrives) or open loop (requests on a fixed schedule). In open loop the
+// latency is measured from the scheduled time, so a slow server is not
+// hidden by the client falling behind.
+void* bench_agency(void* arg) {
+    BenchAgency* self = arg;
+    int agency_id = bench.first_agency + self->index;
+    unsigned int seed = agency_id * 2654435761u;
+    size_t capacity = MAX_DATAGRAM;
+    unsigned char* payload = malloc(capacity);
+    int sock = bench_connect();
+    if (!payload || sock < 0) {
+        self->errors++;
+        free(payload);
+        return NULL;
     }
+
+    struct timespec deadline = bench.start, next = bench.start, now;
+    deadline.tv_sec += bench.duration;
+    uint64_t interval_ns = bench.rate > 0 ? bench.agencies * 1e9 / bench.rate : 0;
+    if (interval_ns) timespec_add_ns(&next, rand_r(&seed) % interval_ns); // Spread the agencies
+
+    while (1) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        struct timespec scheduled = now;
+        if (interval_ns) {
+            if (timespec_before(&now, &next)) {
+                if (!timespec_before(&next, &deadline)) break;
+                clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+            }
+            scheduled = next;
+            timespec_add_ns(&next, interval_ns);
+        }
+        if (!timespec_before(&scheduled, &deadline)) break;
+
+        int pick = rand_r(&seed) % 100, op = 0;
+        while (op < BENCH_OPS - 1 && pick >= bench.mix[op]) pick -= bench.mix[op++];
+        int ref = bench.refs[rand_r(&seed) % bench.num_refs];
+
+        int status = bench_request(sock, op, agency_id, ref, &payload, &capacity);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (status < 0) {
+            self->errors++;
+            if (bench.tcp) break; // The connection is gone
+            continue;
+        }
+        hist_add(&self->latency[op], elapsed_us(&scheduled, &now));
+        if (status == ST_SUCCESS) {
+            self->succeeded++;
+        } else if (status == ST_BUSY) {
+            self->busy++;
+        } else {
+            self->failed++;
+        }
+    }
+    close(sock);
+    free(payload);
+    return NULL;
+}
+
+// Flight refs to book when none are given: ask the server for its catalogue
+int fetch_refs() {
+    int sock = bench_connect();
+    size_t capacity = MAX_DATAGRAM;
+    unsigned char* payload = malloc(capacity);
+    if (sock < 0 || !payload) return -1;
+    int status = bench_request(sock, BENCH_CONSULT, 0, 0, &payload, &capacity);
+    close(sock);
+    if (status != ST_SUCCESS) {
+        free(payload);
+        return -1;
+    }
+
+    if (bench.tcp) {
+        uint32_t count = get_u32(payload);
+        bench.refs = malloc((count ? count : 1) * sizeof(int));
+        const unsigned char* p = payload + 4;
+        for (uint32_t i = 0; i < count; i++) {
+            bench.refs[bench.num_refs++] = get_u32(p);
+            p += 12;
+            p += 1 + *p;
+        }
+    } else {
+        int capacity_refs = 16;
+        bench.refs = malloc(capacity_refs * sizeof(int));
+        for (char* line = strtok((char*)payload, "\n"); line; line = strtok(NULL, "\n")) {
+            int ref;
+            if (sscanf(line, "%d", &ref) != 1) continue;
+            if (bench.num_refs == capacity_refs) {
+                capacity_refs *= 2;
+                bench.refs = realloc(bench.refs, capacity_refs * sizeof(int));
+            }
+            bench.refs[bench.num_refs++] = ref;
+        }
+    }
+    free(payload);
+    return bench.num_refs > 0 ? 0 : -1;
+}
+
+// Parse a comma-separated list of integers; returns how many were read
+int parse_int_list(const char* text, int* values, int max) {
+    int count = 0;
+    while (count < max && *text) {
+        char* end;
+        values[count++] = strtol(text, &end, 10);
+        if (*end != ',') break;
+        text = end + 1;
+    }
+    return count;
+}
+
+void bench_usage(const char* program) {
+    printf("Usage: %s --bench [-p tcp|udp] [-P port] [-a agences] [-d secondes]"
+           " [-r requetes_par_seconde (0: boucle fermée)]"
+           " [-m reserve,cancel,invoice,consult (%%)] [-f ref1,ref2,...]"
+           " [-s places] [-i premiere_agence]\n", program);
+    exit(EXIT_FAILURE);
+}
+
+void print_latency(const char* name, const Histogram* h) {
+    if (h->total == 0) return;
+    printf("%-8s %10llu %10.3f %10.3f %10.3f %10.3f\n", name, (unsigned long long)h->total,
+           hist_percentile(h, 0.50) / 1000.0, hist_percentile(h, 0.99) / 1000.0,
+           hist_percentile(h, 0.999) / 1000.0, h->max / 1000.0);
+}
+
+// Non-interactive load generator: many simulated agencies against a running
+// server, then a throughput and latency report
+int bench_main(int argc, char* argv[], const char* program) {
+    bench.tcp = 1;
+    bench.agencies = 16;
+    bench.duration = 10;
+    bench.seats = 1;
+    bench.first_agency = 1000;
+    int mix[BENCH_OPS] = {70, 20, 5, 5};
+    int port = 8080;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:P:a:d:r:m:f:s:i:")) != -1) {
+        if (opt == 'p' && (strcmp(optarg, "tcp") == 0 || strcmp(optarg, "udp") == 0)) {
+            bench.tcp = strcmp(optarg, "tcp") == 0;
+        } else if (opt == 'P' && atoi(optarg) > 0) {
+            port = atoi(optarg); // Server port (8080 by default)
+        } else if (opt == 'a' && atoi(optarg) > 0) {
+            bench.agencies = atoi(optarg);
+        } else if (opt == 'd' && atoi(optarg) > 0) {
+            bench.duration = atoi(optarg);
+        } else if (opt == 'r' && atof(optarg) >= 0) {
+            bench.rate = atof(optarg);
+        } else if (opt == 'm') {
+            if (parse_int_list(optarg, mix, BENCH_OPS) != BENCH_OPS) bench_usage(program);
+        } else if (opt == 'f') {
+            bench.refs = malloc((strlen(optarg) / 2 + 1) * sizeof(int));
+            bench.num_refs = parse_int_list(optarg, bench.refs, strlen(optarg) / 2 + 1);
+        } else if (opt == 's' && atoi(optarg) > 0) {
+            bench.seats = atoi(optarg);
+        } else if (opt == 'i') {
+            bench.first_agency = atoi(optarg);
+        } else {
+            bench_usage(program);
+        }
+    }
+    int mix_total = 0;
+    for (int i = 0; i < BENCH_OPS; i++) {
+        if (mix[i] < 0) bench_usage(program);
+        mix_total += mix[i];
+    }
+    if (mix_total != 100) {
+        printf("Le mélange -m doit totaliser 100%%\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(bench.mix, mix, sizeof(mix));
+
+    bench.server_addr.sin_family = AF_INET;
+    bench.server_addr.sin_port = htons(port);
+    bench.server_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    if (bench.num_refs == 0 && fetch_refs() < 0) {
+        printf("Impossible de récupérer la liste des vols\n");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%d agences (%s), %d s, %s, %d vols\n", bench.agencies, bench.tcp ? "tcp" : "udp",
+           bench.duration, bench.rate > 0 ? "boucle ouverte" : "boucle fermée", bench.num_refs);
+    BenchAgency* agencies = calloc(bench.agencies, sizeof(BenchAgency));
+    pthread_t* threads = malloc(bench.agencies * sizeof(pthread_t));
+    if (!agencies || !threads) {
+        perror("Erreur d'allocation");
+        exit(EXIT_FAILURE);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &bench.start);
+    for (int i = 0; i < bench.agencies; i++) {
+        agencies[i].index = i;
+        if (pthread_create(&threads[i], NULL, bench_agency, &agencies[i]) != 0) {
+            perror("Erreur lors de la création du thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+    Histogram latency[BENCH_OPS] = {0}, all = {0};
+    uint64_t succeeded = 0, failed = 0, busy = 0, errors = 0;
+    for (int i = 0; i < bench.agencies; i++) {
+        pthread_join(threads[i], NULL);
+        for (int op = 0; op < BENCH_OPS; op++) {
+            hist_merge(&latency[op], &agencies[i].latency[op]);
+            hist_merge(&all, &agencies[i].latency[op]);
+        }
+        succeeded += agencies[i].succeeded;
+        failed += agencies[i].failed;
+        busy += agencies[i].busy;
+        errors += agencies[i].errors;
+    }
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = elapsed_us(&bench.start, &end) / 1e6;
+
+    printf("Requêtes: %llu (succès %llu, refus %llu, BUSY %llu), erreurs: %llu\n",
+           (unsigned long long)all.total, (unsigned long long)succeeded,
+           (unsigned long long)failed, (unsigned long long)busy, (unsigned long long)errors);
+    printf("Débit: %.0f requêtes/s\n", all.total / seconds);
+    printf("%-8s %10s %10s %10s %10s %10s\n", "latence", "nombre", "p50 ms", "p99 ms", "p99.9 ms", "max ms");
+    for (int op = 0; op < BENCH_OPS; op++) print_latency(bench_op_names[op], &latency[op]);
+    print_latency("total", &all);
+    free(agencies);
+    free(threads);
+    return all.total > 0 ? 0 : EXIT_FAILURE;
+}
+
+// Local copy of the catalogue kept up to date by OP_NOTIFY frames
+typedef struct {
+    int ref;
+    int seats;
+    int price;
+    char destination[50];
+} WatchedFlight;
+
+WatchedFlight* find_watched(WatchedFlight* flights, int count, int ref) {
+    for (int i = 0; i < count; i++) {
+        if (flights[i].ref == ref) return &flights[i];
+    }
+    return NULL;
+}
+
+// Watch mode: one OP_CONSULT for the flight details, then OP_SUBSCRIBE and
+// print every seat change pushed by the server, without ever polling
+int watch_main(int argc, char* argv[], const char* program) {
+    int port = 8080;
+    int opt;
+    while ((opt = getopt(argc, argv, "P:")) != -1) {
+        if (opt == 'P' && atoi(optarg) > 0) {
+            port = atoi(optarg); // Server port (8080 by default)
+        } else {
+            printf("Usage: %s --watch [-P port] [références des vols]\n", program);
+            return EXIT_FAILURE;
+        }
+    }
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in server_addr;
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    server_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    if (sock < 0 || connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        perror("Erreur lors de la connexion au serveur");
+        return EXIT_FAILURE;
+    }
+
+    size_t capacity = MAX_DATAGRAM;
+    unsigned char* payload = malloc(capacity);
+    uint32_t length;
+    unsigned char request[FRAME_HEADER_SIZE + 4 + 4 * 256];
+    encode_frame_header(request, OP_CONSULT, 0, 1, 0);
+    if (!payload || send_all(sock, request, FRAME_HEADER_SIZE) < 0 ||
+        recv_frame(sock, &payload, &capacity, &length) != ST_SUCCESS || length < 4) {
+        printf("Consultation impossible\n");
+        return EXIT_FAILURE;
+    }
+    uint32_t count = get_u32(payload);
+    WatchedFlight* flights = calloc(count ? count : 1, sizeof(WatchedFlight));
+    const unsigned char* p = payload + 4;
+    for (uint32_t i = 0; i < count; i++) {
+        flights[i].ref = get_u32(p);
+        flights[i].seats = get_u32(p + 4);
+        flights[i].price = get_u32(p + 8);
+        int size = p[12] < sizeof(flights[i].destination) ? p[12] : sizeof(flights[i].destination) - 1;
+        memcpy(flights[i].destination, p + 13, size);
+        p += 13 + p[12];
+    }
+
+    int num_refs = argc - optind < 256 ? argc - optind : 256;
+    for (int i = 0; i < num_refs; i++) {
+        put_u32(request + FRAME_HEADER_SIZE + 4 + 4 * i, atoi(argv[optind + i]));
+    }
+    put_u32(request + FRAME_HEADER_SIZE, num_refs);
+    encode_frame_header(request, OP_SUBSCRIBE, 0, 2, 4 + 4 * num_refs);
+    if (send_all(sock, request, FRAME_HEADER_SIZE + 4 + 4 * num_refs) < 0 ||
+        recv_frame(sock, &payload, &capacity, &length) != ST_SUCCESS) {
+        printf("Abonnement refusé\n");
+        return EXIT_FAILURE;
+    }
+    printf("Abonné aux %s, en attente des changements\n", num_refs ? "vols demandés" : "vols");
+
+    int first = 1;
+    while (recv_frame(sock, &payload, &capacity, &length) == ST_SUCCESS) {
+        if (length < 12) break;
+        uint64_t version = get_u64(payload);
+        uint32_t changed = get_u32(payload + 8);
+        if (length < 12 + 8 * (uint64_t)changed) break;
+        for (uint32_t i = 0; i < changed; i++) {
+            int ref = get_u32(payload + 12 + 8 * i);
+            int seats = get_u32(payload + 16 + 8 * i);
+            WatchedFlight* flight = find_watched(flights, count, ref);
+            if (!flight) continue; // Added after our consultation
+            // The first notification is the current state of every flight
+            if (first || flight->seats != seats) {
+                printf("[v%llu] Vol %d (%s, %d €): %d places\n", (unsigned long long)version,
+                       flight->ref, flight->destination, flight->price, seats);
+            }
+            flight->seats = seats;
+        }
+        fflush(stdout);
+        first = 0;
+    }
+    printf("Connexion au serveur perdue\n");
+    close(sock);
+    free(flights);
+    free(payload);
+    return EXIT_FAILURE;
 }
 
 int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        printf("Usage: %s <id_agence> <protocol> (tcp or udp)\n", argv[0]);
+    if (argc >= 2 && strcmp(argv[1], "--bench") == 0) {
+        return bench_main(argc - 1, argv + 1, argv[0]);
+    }
+    if (argc >= 2 && strcmp(argv[1], "--watch") == 0) {
+        return watch_main(argc - 1, argv + 1, argv[0]);
+    }
+    if (argc != 3 && argc != 4) {
+        printf("Usage: %s <id_agence> <protocol> (tcp or udp) [port (8080)]\n", argv[0]);
+        printf("       %s --bench [options]\n", argv[0]);
+        printf("       %s --watch [-P port] [références des vols]\n", argv[0]);
         exit(EXIT_FAILURE);
     }
     int agency_id = atoi(argv[1]);
     char* protocol = argv[2];
+    udp_agency_id = agency_id;
+    // Random start: two runs of the same agency (restarted, or side by side)
+    // must not reuse ids still in the server's reply cache
+    if (getrandom(&udp_next_id, sizeof(udp_next_id), 0) != sizeof(udp_next_id)) {
+        udp_next_id = (uint32_t)time(NULL) ^ (uint32_t)getpid() << 16;
+    }
 
     // Validate protocol
     if (strcmp(protocol, "tcp") != 0 && strcmp(protocol, "udp") != 0) {
@@ -68,7 +624,7 @@ int main(int argc, char *argv[]) {
 
     struct sockaddr_in server_addr;
     server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(8080);
+    server_addr.sin_port = htons(argc == 4 ? atoi(argv[3]) : 8080);
     server_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
 
     // Connect to server for TCP only
@@ -90,6 +646,11 @@ int main(int argc, char *argv[]) {
         printf("3. Demander la facture\n");
         printf("4. Consulter les vols\n");
         printf("5. Quitter\n");
+        if (strcmp(protocol, "tcp") == 0) printf("6. Réservations en rafale (pipeline)\n");
+        printf("7. Historique de l'agence\n");
+        printf("8. Rechercher des vols\n");
+        printf("9. Bloquer des places (puis confirmer ou libérer)\n");
+        printf("10. Réserver un itinéraire (tous les vols ou aucun)\n");
         printf("Votre choix: ");
 
         int choice;
@@ -136,6 +697,94 @@ int main(int argc, char *argv[]) {
             printf("Liste des vols:\n%s", response);
         } else if (choice == 5) {
             break;
+        } else if (choice == 6 && strcmp(protocol, "tcp") == 0) {
+            int ref, seats, count;
+            printf("Entrez la référence du vol: ");
+            scanf("%d", &ref);
+            printf("Entrez le nombre de places par réservation: ");
+            scanf("%d", &seats);
+            printf("Entrez le nombre de réservations: ");
+            scanf("%d", &count);
+            getchar();
+            if (count > 0) pipeline_reserve(sock, agency_id, ref, seats, count);
+        } else if (choice == 7) {
+            // One page at a time, newest first; the server says where to resume
+            unsigned int cursor = 0;
+            do {
+                snprintf(request, sizeof(request), "HISTORY AGENCY %d %u 20", agency_id, cursor);
+                send_request(sock, protocol, request, response, sizeof(response), &server_addr);
+                char* last = strrchr(response, '\n');
+                last = last ? last + 1 : response;
+                cursor = 0;
+                if (sscanf(last, "NEXT %u", &cursor) == 1 || strcmp(last, "END") == 0) *last = '\0';
+                printf("%s", response);
+                if (cursor == 0) break;
+                printf("Page suivante ? (o/n): ");
+            } while (fgets(request, sizeof(request), stdin) && request[0] == 'o');
+        } else if (choice == 8) {
+            char destination[50];
+            int seats, max_price;
+            printf("Destination (* pour toutes): ");
+            scanf("%49s", destination);
+            printf("Nombre de places minimum: ");
+            scanf("%d", &seats);
+            printf("Prix maximum par place: ");
+            scanf("%d", &max_price);
+            getchar();
+            int len = snprintf(request, sizeof(request), "SEARCH seats>=%d price<=%d sort=price", seats, max_price);
+            if (strcmp(destination, "*") != 0) {
+                snprintf(request + len, sizeof(request) - len, " destination=%s", destination);
+            }
+            send_request(sock, protocol, request, response, sizeof(response), &server_addr);
+            if (strcmp(response, "FAILURE") == 0) {
+                printf("Aucun vol ne correspond\n");
+            } else {
+                printf("Vols correspondants (du moins cher au plus cher):\n%s", response);
+            }
+        } else if (choice == 9) {
+            int ref, seats, ttl;
+            printf("Entrez la référence du vol: ");
+            scanf("%d", &ref);
+            printf("Entrez le nombre de places: ");
+            scanf("%d", &seats);
+            printf("Durée du blocage (secondes): ");
+            scanf("%d", &ttl);
+            getchar();
+            snprintf(request, sizeof(request), "HOLD %d %d %d %d", ref, agency_id, seats, ttl);
+            send_request(sock, protocol, request, response, sizeof(response), &server_addr);
+            unsigned long long hold_id;
+            if (sscanf(response, "HOLD %llu", &hold_id) != 1) {
+                printf("Réponse du serveur: %s\n", response);
+                continue;
+            }
+            printf("Places bloquées %d s. Confirmer (c) ou libérer (l) ? ", ttl);
+            char answer[16] = "";
+            if (!fgets(answer, sizeof(answer), stdin)) break;
+            snprintf(request, sizeof(request), "%s %llu", answer[0] == 'c' ? "CONFIRM" : "RELEASE", hold_id);
+            send_request(sock, protocol, request, response, sizeof(response), &server_addr);
+            if (strcmp(response, "SUCCESS") == 0) {
+                printf(answer[0] == 'c' ? "Réservation confirmée\n" : "Places libérées\n");
+            } else {
+                printf("Blocage expiré (réponse du serveur: %s)\n", response);
+            }
+        } else if (choice == 10) {
+            int legs;
+            printf("Nombre de vols de l'itinéraire: ");
+            scanf("%d", &legs);
+            int len = snprintf(request, sizeof(request), "RESERVE_BATCH %d", agency_id);
+            for (int i = 0; i < legs && len < (int)sizeof(request); i++) {
+                int ref, seats;
+                printf("Vol %d - référence et nombre de places: ", i + 1);
+                scanf("%d %d", &ref, &seats);
+                len += snprintf(request + len, sizeof(request) - len, " %d %d", ref, seats);
+            }
+            getchar();
+            send_request(sock, protocol, request, response, sizeof(response), &server_addr);
+            if (strcmp(response, "SUCCESS") == 0) {
+                printf("Itinéraire réservé\n");
+            } else {
+                printf("Itinéraire non réservé, aucune place prise (réponse du serveur: %s)\n", response);
+            }
         } else {
             printf("Choix invalide\n");
         }
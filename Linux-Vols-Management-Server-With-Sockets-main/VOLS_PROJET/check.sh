@@ -0,0 +1,178 @@
+#!/bin/bash
+# Tests de bout en bout ("make check"): lance le serveur dans un répertoire
+# temporaire, le pilote avec agency (et volsbin), puis vérifie les places,
+# les factures et histo.txt. Usage: check.sh [répertoire] [port]
+BIN=$(cd "$(dirname "$0")" && pwd)
+DIR=${1:-/tmp/vols_check}
+PORT=${2:-18080}
+failures=0
+server_pid=
+
+# check description attendu obtenu
+check() {
+    if [ "$2" = "$3" ]; then
+        echo "ok     $1"
+    else
+        echo "ÉCHEC  $1: attendu '$2', obtenu '$3'"
+        failures=$((failures + 1))
+    fi
+}
+
+# start_server protocole [options du serveur]: démarre dans $DIR, la console
+# du serveur restant ouverte sur le descripteur 9
+start_server() {
+    local protocol=$1
+    shift
+    rm -f "$DIR/console" && mkfifo "$DIR/console"
+    (cd "$DIR" && exec "$BIN/server" -p "$PORT" "$@" < console >> server.log 2>&1) &
+    server_pid=$!
+    exec 9> "$DIR/console"
+    echo "$protocol" >&9
+    for i in $(seq 50); do
+        if [ "$protocol" = tcp ]; then
+            (echo > /dev/tcp/127.0.0.1/$PORT) 2> /dev/null && return
+        else
+            [ -n "$(udp_request CONSULT | tr -d '\n')" ] && return
+        fi
+        sleep 0.1
+    done
+    echo "Le serveur ne répond pas (voir $DIR/server.log)"
+    exit 1
+}
+
+# Arrêt propre par la console: journal synchronisé, fichiers réécrits
+stop_server() {
+    echo exit >&9
+    exec 9>&-
+    wait "$server_pid"
+    server_pid=
+}
+
+trap '[ -n "$server_pid" ] && kill "$server_pid" 2> /dev/null' EXIT
+
+# agency id protocole: réponses au menu sur l'entrée standard
+agency() {
+    "$BIN/agency" "$1" "$2" "$PORT"
+}
+
+# Places restantes du vol ref (CONSULT)
+seats() {
+    printf '4\n5\n' | agency 1 "${2:-tcp}" | awk -v ref="$1" '$1 == ref { print $3 }'
+}
+
+# Montant facturé à une agence (INVOICE)
+invoice() {
+    printf '3\n5\n' | agency "$1" "${2:-tcp}" | sed -n 's/.*Facture: INVOICE //p'
+}
+
+# Datagrammes bruts envoyés depuis un même socket (comme un client qui
+# renvoie sa demande), une réponse du serveur par ligne
+udp_request() {
+    exec 3<> /dev/udp/127.0.0.1/$PORT
+    for request in "$@"; do
+        printf '%s' "$request" >&3
+        timeout 1 dd bs=65536 count=1 <&3 2> /dev/null
+        echo
+    done
+    exec 3<&-
+}
+
+# Lignes de succès de histo.txt (et de ses segments) pour une agence
+journal_lines() {
+    cat "$DIR"/archive/histo-*.txt "$DIR"/histo-*.txt "$DIR"/histo.txt 2> /dev/null |
+        awk -v agency="$1" '$2 == agency && $4 != "" && /succès/' | wc -l
+}
+
+# Vols et factures de toutes les agences utilisées
+state() {
+    printf '4\n5\n' | agency 1 tcp | awk '$1 ~ /^[0-9]+$/ && NF == 4'
+    for id in 11 12 13 14 15 16 17 18 21 31; do
+        echo "$id $(invoice $id)"
+    done
+}
+
+rm -rf "$DIR" && mkdir -p "$DIR" || exit 1
+cat > "$DIR/vols.txt" << EOF
+1000 Paris 100 10
+2000 London 5 20
+3000 Moscow 5 30
+4000 Tokyo 5 40
+EOF
+cp "$DIR/vols.txt" "$DIR/vols.orig"
+
+# Segments de 1 Ko, compaction et point de reprise fréquents
+start_server tcp -j 1 -f 100 -c 1
+
+echo "== Places par compare-and-swap (user-002)"
+for id in 11 12 13 14 15 16 17 18; do
+    printf '6\n1000\n1\n20\n5\n' | agency $id tcp > "$DIR/agency-$id.log" &
+done
+wait $(jobs -p | grep -v "^$server_pid\$")
+booked=$(cat "$DIR"/agency-1?.log | sed -n 's/.* \([0-9]*\) réservations réussies.*/\1/p' |
+         awk '{ n += $1 } END { print n }')
+check "160 demandes pour 100 places: 100 acceptées" 100 "$booked"
+check "plus aucune place sur le vol 1000" 0 "$(seats 1000)"
+total=$(for id in 11 12 13 14 15 16 17 18; do invoice $id; done | awk '{ s += $1 } END { printf "%.2f", s }')
+check "factures: 100 places à 10" 1000.00 "$total"
+
+echo "== Acquittement après le journal (user-005)"
+acked=0
+for id in 11 12 13 14 15 16 17 18; do
+    acked=$((acked + $(journal_lines $id)))
+done
+check "chaque réservation acquittée est déjà dans histo.txt" 100 "$acked"
+
+echo "== Itinéraire tout ou rien (user-017)"
+out=$(printf '10\n3\n2000 2\n3000 2\n4000 9\n5\n' | agency 21 tcp)
+check "itinéraire impossible refusé" 1 "$(echo "$out" | grep -c 'Itinéraire non réservé')"
+check "aucune place prise" "5 5 5" "$(seats 2000) $(seats 3000) $(seats 4000)"
+out=$(printf '10\n2\n2000 2\n3000 2\n5\n' | agency 21 tcp)
+check "itinéraire possible réservé" 1 "$(echo "$out" | grep -c 'Itinéraire réservé')"
+check "places prises sur chaque vol" "3 3" "$(seats 2000) $(seats 3000)"
+check "une ligne journalisée pour l'itinéraire" 1 "$(journal_lines 21)"
+
+echo "== Expiration des blocages (user-016)"
+out=$( (printf '9\n4000\n2\n1\n'; sleep 0.5; seats 4000 > "$DIR/held"; sleep 1.5; printf 'c\n5\n') |
+      agency 31 tcp)
+check "places retirées pendant le blocage" 3 "$(cat "$DIR/held")"
+check "CONFIRM après l'expiration refusé" 1 "$(echo "$out" | grep -c 'Blocage expiré')"
+check "places rendues à l'expiration" 5 "$(seats 4000)"
+check "rien de facturé" 0.00 "$(invoice 31)"
+
+echo "== Compaction et rejeu (user-023)"
+sleep 2 # Compaction et point de reprise
+check "segments compactés dans histo.agg" 1 "$(ls "$DIR"/archive/histo-*.txt > /dev/null 2>&1 &&
+                                                  [ -f "$DIR/histo.agg" ] && echo 1)"
+state > "$DIR/state.before"
+stop_server
+start_server tcp
+state > "$DIR/state.after"
+check "même état après redémarrage (point de reprise)" "" "$(diff "$DIR/state.before" "$DIR/state.after")"
+stop_server
+rm -f "$DIR/checkpoint.txt"
+start_server tcp -c 0
+state > "$DIR/state.after"
+check "même état sans point de reprise (histo.agg et rejeu)" "" \
+      "$(diff "$DIR/state.before" "$DIR/state.after")"
+stop_server
+"$BIN/volsbin" import "$DIR/vols.txt" "$DIR/vols.bin" > /dev/null
+start_server tcp -b
+state > "$DIR/state.after"
+check "même état depuis vols.bin (volsbin import)" "" "$(diff "$DIR/state.before" "$DIR/state.after")"
+stop_server
+
+echo "== Datagrammes UDP rejoués (user-022)"
+rm -rf "$DIR/udp" && mkdir -p "$DIR/udp" && cp "$DIR/vols.orig" "$DIR/udp/vols.txt" && DIR=$DIR/udp
+start_server udp
+replies=$(udp_request '#41:7 RESERVE 1000 41 1' '#41:7 RESERVE 1000 41 1' | paste -sd '|')
+check "même réponse à la demande et à son renvoi" "#41:7 SUCCESS|#41:7 SUCCESS" "$replies"
+check "une seule place prise" 99 "$(seats 1000 udp)"
+check "une seule facturation" 10.00 "$(invoice 41 udp)"
+check "une seule ligne journalisée" 1 "$(journal_lines 41)"
+stop_server
+
+if [ $failures -gt 0 ]; then
+    echo "$failures vérification(s) en échec (fichiers dans $DIR)"
+    exit 1
+fi
+echo "Toutes les vérifications sont passées"
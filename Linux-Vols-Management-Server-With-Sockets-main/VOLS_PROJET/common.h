@@ -1,8 +1,7 @@
 #ifndef COMMON_H
 #define COMMON_H
 
-#define MAX_FLIGHTS 100
-#define MAX_AGENCIES 100
+#include <stdint.h>
 
 typedef struct {
     int ref;              // Flight reference number
@@ -11,4 +10,168 @@ typedef struct {
     int price;            // Price per seat
 } Flight;
 
-#endif
\ No newline at end of file
+// Framed binary protocol (TCP), accepted alongside the text commands.
+// Every frame starts with a 12-byte header, all integers in network order:
+//   magic (1) | opcode (1) | status (2) | request id (4) | payload length (4)
+// A reply carries the opcode and request id of its request, so a client can
+// pipeline many requests on one connection and match the replies.
+#define FRAME_MAGIC 0xF7      // Never the first byte of a text command
+#define FRAME_HEADER_SIZE 12
+#define MAX_FRAME_PAYLOAD 65536
+
+// Opcodes and request payloads
+#define OP_RESERVE 1  // ref, agency id, seats (3 x int32)
+#define OP_CANCEL 2   // ref, agency id, seats (3 x int32)
+#define OP_INVOICE 3  // agency id (int32) -> total in cents (int64)
+#define OP_CONSULT 4  // none -> count (uint32), then per flight: ref, seats,
+                      // price (3 x int32), destination length (uint8), bytes
+#define OP_TEXT 5     // any text command -> its text reply
+#define OP_CONSULT_SINCE 6 // catalogue version (uint64) -> current version
+                           // (uint64), then the flights changed since, as
+                           // in OP_CONSULT
+#define OP_STATS 7    // none -> statistics report (text, one metric per line)
+#define OP_SUBSCRIBE 8 // count (uint32), refs (int32 each; none: all flights)
+                       // -> status only. The connection then only carries
+                       // OP_NOTIFY frames: the first one lists every
+                       // subscribed flight, the next ones what changed.
+#define OP_NOTIFY 9   // pushed, request id 0: catalogue version (uint64),
+                      // count (uint32), then per flight: ref, seats (int32)
+#define OP_HISTORY 10 // kind (uint32), key (int64), to (int64), cursor,
+                      // limit (2 x uint32) -> next cursor (uint32, 0: last
+                      // page), then the matching histo.txt lines, newest first
+#define OP_SEARCH 11  // min seats, min price, max price, order, limit (5 x int32;
+                      // max price INT32_MAX, limit 0: no bound), destination
+                      // length (uint8), bytes (none: any) -> as OP_CONSULT,
+                      // matching flights only
+#define OP_HOLD 12     // ref, agency id, seats, ttl in seconds (4 x int32)
+                      // -> hold id (uint64). Holds are volatile: only
+                      // CONFIRM is journaled, so a restart gives the seats
+                      // of pending holds back and their ids stop working.
+#define OP_CONFIRM 13  // hold id (uint64): the held seats are booked and billed
+#define OP_RELEASE 14  // hold id (uint64): the held seats are given back
+#define OP_RESERVE_BATCH 15 // agency id, count (uint32), then per flight: ref,
+                            // seats (int32). All flights are booked, or none.
+#define OP_JOURNAL 16 // journal position (uint64), max bytes (uint32) ->
+                      // durable end of the journal (uint64), then the whole
+                      // lines from that position (none: nothing new yet).
+                      // Read replicas poll it to copy the journal. FAILURE
+                      // if the position was compacted away (histo.agg).
+                      // Served only on the replication port (server -J),
+                      // UNKNOWN on the agency port.
+
+// SEARCH orders
+#define SEARCH_BY_PRICE 0      // Cheapest first
+#define SEARCH_BY_PRICE_DESC 1
+#define SEARCH_BY_SEATS 2      // Most available seats first
+#define SEARCH_BY_REF 3
+
+// HISTORY kinds: every transaction, one agency or flight (key), or the
+// timestamps from key to "to" (seconds since the epoch)
+#define HISTORY_ALL 0
+#define HISTORY_AGENCY 1
+#define HISTORY_FLIGHT 2
+#define HISTORY_TIME 3
+
+// Reply status
+#define ST_SUCCESS 0
+#define ST_FAILURE 1
+#define ST_INVALID 2
+#define ST_UNKNOWN 3
+#define ST_SERVER_ERROR 4
+#define ST_BUSY 5         // Server overloaded or agency over its rate limit:
+                          // nothing was done, retry later
+#define ST_READ_ONLY 6    // Change sent to a read replica: use the primary
+
+static inline void put_u32(unsigned char *p, uint32_t v) {
+    p[0] = v >> 24; p[1] = (v >> 16) & 0xff; p[2] = (v >> 8) & 0xff; p[3] = v & 0xff;
+}
+
+static inline uint32_t get_u32(const unsigned char *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static inline void put_u64(unsigned char *p, uint64_t v) {
+    put_u32(p, v >> 32);
+    put_u32(p + 4, v & 0xffffffff);
+}
+
+static inline uint64_t get_u64(const unsigned char *p) {
+    return (uint64_t)get_u32(p) << 32 | get_u32(p + 4);
+}
+
+static inline void encode_frame_header(unsigned char *p, int opcode, int status,
+                                       uint32_t request_id, uint32_t length) {
+    p[0] = FRAME_MAGIC;
+    p[1] = opcode;
+    p[2] = (status >> 8) & 0xff;
+    p[3] = status & 0xff;
+    put_u32(p + 4, request_id);
+    put_u32(p + 8, length);
+}
+
+static inline void decode_frame_header(const unsigned char *p, int *opcode, int *status,
+                                       uint32_t *request_id, uint32_t *length) {
+    *opcode = p[1];
+    *status = p[2] << 8 | p[3];
+    *request_id = get_u32(p + 4);
+    *length = get_u32(p + 8);
+}
+
+// Latency histogram: values below 16 get their own bucket, above that each
+// power of two is split into 16 linear sub-buckets, so any percentile is
+// reported within ~6%. Written by a single thread; other threads may merge
+// it concurrently (relaxed atomics, no lock).
+#define HIST_SUB_BITS 4
+#define HIST_BUCKETS (64 << HIST_SUB_BITS)
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+} Histogram;
+
+static inline int hist_index(uint64_t value) {
+    if (value < (1 << HIST_SUB_BITS)) return value;
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS) + ((value >> shift) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+// Largest value that falls in a bucket
+static inline uint64_t hist_bucket_max(int index) {
+    if (index < (1 << HIST_SUB_BITS)) return index;
+    int shift = (index >> HIST_SUB_BITS) - 1;
+    uint64_t sub = index & ((1 << HIST_SUB_BITS) - 1);
+    return (((1 << HIST_SUB_BITS) + sub) << shift) + ((uint64_t)1 << shift) - 1;
+}
+
+static inline void hist_add(Histogram *h, uint64_t value) {
+    uint64_t *count = &h->counts[hist_index(value)];
+    __atomic_store_n(count, *count + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->total, h->total + 1, __ATOMIC_RELAXED);
+    if (value > h->max) __atomic_store_n(&h->max, value, __ATOMIC_RELAXED);
+}
+
+static inline void hist_merge(Histogram *into, const Histogram *from) {
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        into->counts[i] += __atomic_load_n(&from->counts[i], __ATOMIC_RELAXED);
+    }
+    into->total += __atomic_load_n(&from->total, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+    if (max > into->max) into->max = max;
+}
+
+static inline uint64_t hist_percentile(const Histogram *h, double q) {
+    uint64_t target = (uint64_t)(q * h->total + 0.999999);
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= target && seen > 0) {
+            uint64_t value = hist_bucket_max(i);
+            return value < h->max ? value : h->max;
+        }
+    }
+    return h->max;
+}
+
+#endif
@@ -1,292 +1,4564 @@
 // Programme serveur pour le système de réservation de vols
+#define _GNU_SOURCE // recvmmsg, sendmmsg
 #include "common.h"
+#include "volsbin.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <limits.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <time.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <netdb.h>
+#include <dirent.h>
+
+#define DEFAULT_WORKERS 4      // Threads du pool TCP par défaut
+#define MAX_EVENTS 32          // Événements epoll traités par appel
+#define MAX_READS_PER_EVENT 16 // Lectures par connexion avant de céder la main
+#define UDP_BATCH 32           // Datagrammes reçus/envoyés par appel système
+#define UDP_REQUEST_MAX 256    // Taille maximale d'une requête UDP
+#define UDP_REPLY_MAX 65507    // Plus grande réponse tenant dans un datagramme IPv4
+#define UDP_DEDUP_BUCKETS 1024 // Réponses UDP gardées par worker: seaux (puissance de 2)
+#define UDP_DEDUP_WAYS 4       // ... de 4 réponses chacun
+#define UDP_DEDUP_REPLY_MAX 256 // Réponses plus longues (lectures) recalculées
+#define OUT_HIGH_WATER 65536   // Au-delà, on cesse de lire le client
+#define IN_HIGH_WATER (4 * MAX_FRAME_PAYLOAD) // Octets lus avant de traiter
+#define AGENCY_CHUNK_SIZE 4096  // Agences allouées par bloc
+#define AGENCY_MAX_CHUNKS 16384 // Soit jusqu'à 67 millions d'agences
+#define DEFAULT_CHECKPOINT_INTERVAL 30 // Secondes entre deux points de reprise
+#define DEFAULT_FLUSH_INTERVAL 1000    // ms entre deux écritures de vols.txt/facture.txt
+#define DEFAULT_MAX_QUEUE 10000 // Requêtes en attente du journal avant BUSY
+#define CHANGE_RING_SIZE 65536 // Derniers vols modifiés, par version (puissance de 2)
+#define VERSION_LEASE (1 << 20) // Versions réservées à la fois dans version.txt
+#define SUBSCRIBER_HIGH_WATER 65536 // Notifications en attente avant coalescence
+#define HISTORY_CHUNK_SIZE 65536    // Entrées de l'index de l'historique par bloc
+#define HISTORY_MAX_CHUNKS 16384    // Soit jusqu'à un milliard de transactions
+#define HISTORY_KEY_CHUNK_SIZE 4096 // Vols/agences de l'index par bloc
+#define HISTORY_MAX_KEY_CHUNKS 16384
+#define HISTORY_PAGE_DEFAULT 50     // Transactions par page de HISTORY
+#define HISTORY_PAGE_MAX 500
+#define MAX_BATCH_LEGS 16      // Vols par RESERVE_BATCH
+#define JOURNAL_LINE_MAX 512   // Plus longue ligne de histo.txt (lot complet)
+#define DEFAULT_SEGMENT_SIZE (64 * 1024) // Ko de histo.txt avant rotation du segment
+#define MAX_SEGMENTS 65536     // Segments du journal suivis (compactés compris)
+#define READER_BLOCK 65536     // Octets lus à la fois en parcourant le journal
+#define REPLAY_CHUNK (4 << 20) // Octets du journal par tâche du rejeu parallèle
+#define MAX_REPLAY_THREADS 64
+#define HOLD_CHUNK_SIZE 65536  // Blocages alloués par bloc
+#define HOLD_MAX_CHUNKS 1024   // Soit jusqu'à 67 millions de blocages en cours
+#define HOLD_TICK_MS 100       // Résolution des expirations
+#define WHEEL_BITS 6           // 64 cases par niveau de la roue
+#define WHEEL_LEVELS 4         // 64^4 ticks: plus de 190 jours
+#define REPLICA_CHUNK (MAX_FRAME_PAYLOAD - 8) // Octets de journal par OP_JOURNAL
+#define REPLICA_POLL_MS 20     // Attente de la réplique quand le primaire n'a rien de neuf
+#define REPLICA_TIMEOUT 10     // Secondes sans réponse avant de se reconnecter
+#define URING_ENTRIES 1024     // SQE par anneau io_uring (option -u)
+#define URING_BATCH 256        // Complétions traitées par lot
+#define URING_ACCEPT 0         // Opération d'une complétion (bits de poids
+#define URING_RECV 1           // faible de user_data, le reste pointe la
+#define URING_SEND 2           // connexion)
+#define URING_WAKE 3           // Lecture de l'event_fd du worker (sans connexion)
+
+// Table de hachage entier -> emplacement (adressage ouvert, sondage linéaire).
+// Les lectures se font sans verrou; les insertions sont faites par un seul
+// thread à la fois et publient la clé avant l'emplacement.
+typedef struct {
+    int *keys;
+    int *slots;      // -1 = case vide
+    size_t capacity; // Puissance de 2
+    size_t count;
+} IntMap;
+
+// Compte d'une agence, créé à sa première transaction
+typedef struct {
+    int id;
+    long long total_payments; // En centimes
+    uint64_t rate_tat;        // Limite de débit (-r): instant théorique (ns)
+                              // de la prochaine requête admise
+} Agency;
 
 // Structures de données globales
-Flight flights[MAX_FLIGHTS];
+// Les places des vols et les paiements sont modifiés sans verrou global:
+// compare-and-swap sur available_seats, additions atomiques sur les totaux.
+Flight *flights = NULL;   // Table des vols, agrandie au chargement
 int num_flights = 0;
-double total_payments[MAX_AGENCIES + 1] = {0}; // Index 0 inutilisé
-pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+int flights_capacity = 0;
+IntMap *flight_index;     // ref -> index dans flights
+uint64_t *flight_versions = NULL; // Version du catalogue à la dernière modification
+uint64_t next_version = 0;        // Dernière version attribuée
+uint64_t version_low_water = UINT64_MAX; // Au-delà, réservation à renouveler (rejeu: jamais)
+int version_renew_wanted = 0;     // Renouvellement demandé au fil de persistance
+pthread_mutex_t version_mutex = PTHREAD_MUTEX_INITIALIZER; // Avec version_cond
+pthread_cond_t version_cond = PTHREAD_COND_INITIALIZER;
+int change_ring[CHANGE_RING_SIZE]; // Vol modifié par chaque version récente
+// Chaque thread qui modifie des vols annonce la version qu'il est en train
+// d'attribuer: les lecteurs en déduisent la version publiée (voir
+// published_version), sans que les écrivains s'attendent entre eux
+typedef struct VersionWriter {
+    uint64_t pending;             // Borne inférieure de la version en cours (0: aucune)
+    struct VersionWriter *next;
+} VersionWriter;
+VersionWriter *version_writers = NULL;
+__thread VersionWriter *my_version_writer = NULL;
+// Index secondaires de SEARCH: index de vols triés par prix, et par
+// destination puis prix. Destination et prix ne changent pas après le
+// chargement; les places, elles, sont lues au moment de la recherche.
+int *flights_by_price = NULL;
+int *flights_by_destination = NULL;
+Agency *agency_chunks[AGENCY_MAX_CHUNKS]; // Blocs d'agences, jamais déplacés
+int num_agencies = 0;
+IntMap *agency_index;     // id -> emplacement de l'agence
+pthread_mutex_t agency_mutex = PTHREAD_MUTEX_INITIALIZER;  // Création d'agences
+
+// Places bloquées par HOLD en attendant CONFIRM ou RELEASE. Les places sont
+// retirées du vol dès le blocage; seul CONFIRM les journalise (comme un
+// RESERVE), si bien qu'un redémarrage rend les places des blocages en cours.
+// status réunit génération et état pour qu'un seul compare-and-swap décide
+// qui, de CONFIRM, RELEASE ou de l'expiration, traite le blocage.
+enum { HOLD_FREE, HOLD_HELD, HOLD_DONE };
+typedef struct Hold {
+    uint64_t status;     // génération << 8 | état; l'identifiant porte la génération
+    uint32_t slot;       // Emplacement dans hold_chunks
+    int flight_idx;
+    Agency *agency;      // Jamais déplacée (agency_chunks)
+    int seats;
+    uint64_t expires;    // Tick d'expiration
+    struct Hold *next;   // Case de la roue, nouveaux blocages ou liste libre
+    struct Hold **pprev; // Lien qui pointe sur ce blocage dans sa case de la roue
+    int in_wheel;        // Placé dans la roue (thread des expirations seulement)
+    struct Hold *finished_next; // Pile des blocages terminés par CONFIRM/RELEASE
+} Hold;
+
+Hold *hold_chunks[HOLD_MAX_CHUNKS];
+uint32_t num_holds = 0;          // Emplacements déjà utilisés
+Hold *free_holds = NULL;         // Emplacements libérés par le thread des expirations
+pthread_mutex_t holds_mutex = PTHREAD_MUTEX_INITIALIZER; // Allocation des blocages
+Hold *new_holds = NULL;          // Pile sans verrou des blocages à placer dans la roue
+Hold *finished_holds = NULL;     // Pile sans verrou des blocages à retirer de la roue
+uint64_t hold_tick = 0;          // Tick courant du thread des expirations
+int active_holds = 0;
+
+// Configuration du front TCP
+int num_workers = DEFAULT_WORKERS;
+int use_uring = 0;            // Option -u: io_uring au lieu d'epoll/write
+int listen_port = 8080;       // Option -p
+int replication_port = 0;     // Option -J: port servant OP_JOURNAL (0: aucun)
+int epoll_fd = -1;
+int listen_sock = -1;
+
+// Notifications poussées aux abonnés: les réservations ne font que réveiller
+// le thread de notification (au plus une écriture eventfd par réveil)
+int notify_fd = -1;           // eventfd de réveil
+int notify_epoll = -1;        // epoll propre au thread de notification
+int notify_pending = 0;       // Réveil déjà demandé
+int num_subscribers = 0;
+struct Subscriber *new_subscribers = NULL; // Confiés par les workers, pas encore adoptés
+pthread_mutex_t subscribers_mutex = PTHREAD_MUTEX_INITIALIZER; // Protège new_subscribers
+
+// Tampon dynamique utilisé pour construire et envoyer les réponses
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} Buffer;
+
+// Réponses CONSULT pré-calculées pour une version du catalogue, partagées en
+// lecture seule par toutes les requêtes tant que les places ne changent pas
+typedef struct {
+    uint64_t version;
+    int refs;      // Requêtes en cours + 1 tant que c'est la version courante
+    Buffer text;   // Réponse à CONSULT
+    Buffer binary; // Charge utile de la réponse OP_CONSULT
+} Catalogue;
+
+Catalogue *catalogue = NULL; // Dernière réponse CONSULT construite
+pthread_mutex_t catalogue_mutex = PTHREAD_MUTEX_INITIALIZER; // Protège catalogue
+
+// Connexion abonnée aux changements de places (SUBSCRIBE). Elle appartient
+// au thread de notification, seul à y écrire.
+typedef struct Subscriber {
+    int fd;
+    int binary;       // Trames OP_NOTIFY (sinon lignes "UPDATE ref places version")
+    int *flights;     // Index des vols suivis, NULL pour tous
+    int num_flights;
+    uint64_t version; // Version du catalogue déjà envoyée
+    int initial;      // Premier envoi: tous les vols suivis
+    int stale;        // Changements pas encore mis en file (abonné en retard)
+    int writing;      // EPOLLOUT demandé
+    int closed;       // Déconnecté: à supprimer
+    Buffer out;
+    struct Subscriber *next;
+} Subscriber;
+
+// État d'une connexion agence TCP
+typedef struct {
+    int fd;
+    Buffer in;    // Octets reçus pas encore traités (trame ou ligne incomplète)
+    Buffer out;   // Octets de réponse pas encore envoyés
+    uint64_t lsn; // Position du journal à rendre durable avant d'envoyer out
+    int closed;   // Le client a fermé la connexion (ou erreur)
+    int yielded;  // Lecture interrompue avant EAGAIN: à reprendre au plus tôt
+    Subscriber *subscriber; // SUBSCRIBE reçu: à confier au thread de notification
+    // Mode io_uring: out continue de se remplir pendant qu'un envoi lit sending
+    Buffer sending;   // Octets remis au noyau par l'envoi en cours
+    int recv_pending; // Réception soumise, pas encore terminée
+    int recv_size;    // Place offerte à cette réception
+    int send_pending;
+    int queued;       // Déjà dans la liste des connexions à relancer
+    int shut;         // shutdown() demandé pour terminer la réception en cours
+    uint64_t parked_ns; // Mise de côté en attendant le journal (statistiques)
+} Connection;
+
+// Journal des transactions (histo.txt), ouvert une fois pour toutes.
+// Les lignes des requêtes concurrentes s'accumulent dans pending; le thread
+// journal_writer les écrit par lots (un write() + un fdatasync() par lot) et
+// fait avancer acked_lsn. Une position (LSN) est un offset dans histo.txt.
+typedef struct {
+    int fd;
+    pthread_mutex_t lock;
+    pthread_cond_t appended; // De nouvelles lignes attendent d'être écrites
+    pthread_cond_t durable;  // acked_lsn a avancé
+    uint64_t base;           // Position du début de histo.txt (segment actif)
+    Buffer pending;          // Lignes pas encore écrites
+    uint64_t appended_lsn;   // Fin de la dernière ligne ajoutée
+    uint64_t acked_lsn;      // Les requêtes jusqu'ici peuvent être acquittées
+    int pending_count;       // Lignes dans pending
+    int queued;              // Lignes ajoutées, pas encore acquittées
+    long long last_time;     // Horodatage de la dernière ligne (jamais décroissant)
+} Journal;
+
+Journal journal = {
+    .fd = -1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .appended = PTHREAD_COND_INITIALIZER,
+    .durable = PTHREAD_COND_INITIALIZER,
+};
+// 0: fdatasync de chaque lot avant d'acquitter. N > 0: acquittement dès le
+// write(), fdatasync au plus toutes les N ms (N ms de pertes possibles en cas
+// de panne de la machine, aucune si seul le processus s'arrête).
+int sync_interval_ms = 0;
+// Contrôle d'admission: au-delà de max_queue lignes en attente du journal
+// (0: aucune limite), ou de agency_rate requêtes par seconde pour une
+// agence (0: aucune limite), les modifications sont refusées par BUSY
+int max_queue = DEFAULT_MAX_QUEUE;
+int agency_rate = 0;
+// Réplique en lecture (-R): adresse du primaire et positions dans son journal
+const char *primary_address = NULL;
+struct sockaddr_in primary_addr;
+uint64_t replica_lsn = 0;  // Fin de ce qui a été recopié et appliqué
+uint64_t primary_lsn = 0;  // Fin durable du journal du primaire, au dernier échange
+
+// Connexions d'un worker dont les réponses attendent que le journal soit
+// durable. Le worker continue de servir les autres connexions; journal_writer
+// le réveille par event_fd dès que wait_lsn est acquitté.
+typedef struct Parked {
+    Connection **list;
+    int count;
+    int cap;
+    int event_fd;
+    uint64_t wait_lsn;   // Plus petite position attendue (0: aucune)
+    struct Parked *next; // Liste des workers, parcourue par journal_writer
+} Parked;
+
+Parked *parked_workers = NULL;
+
+// Segments du journal. histo.txt n'est que le segment actif: au-delà de
+// segment_size octets, le thread du journal le scelle en le renommant
+// histo-<position de début>.txt et en commence un nouveau. Les positions
+// (LSN) restent celles du journal entier, segments mis bout à bout. Les
+// segments scellés que le point de reprise et vols.txt couvrent déjà sont
+// compactés (voir compact_segments): résumés dans histo.agg, puis déplacés
+// dans archive/. Le tableau ne fait que grandir, first avance à chaque
+// compaction; le verrou protège les descripteurs fermés par la compaction
+// contre les lectures en cours.
+typedef struct {
+    uint64_t start;        // Position du premier octet
+    uint64_t end;          // Fin des données écrites
+    int fd;                // Lecture
+} Segment;
+
+typedef struct {
+    Segment list[MAX_SEGMENTS];
+    int first;             // Premier segment non compacté
+    int count;             // Le dernier est le segment actif
+    pthread_rwlock_t lock;
+} Segments;
+
+Segments segments = { .lock = PTHREAD_RWLOCK_INITIALIZER };
+long long segment_size = DEFAULT_SEGMENT_SIZE * 1024LL; // Option -j (0: pas de rotation)
+uint64_t compaction_limit = 0; // Les segments finissant avant peuvent être compactés
+
+// Parcours du journal ligne à ligne, d'un segment au suivant
+typedef struct {
+    uint64_t lsn;          // Début de la prochaine ligne
+    uint64_t block_lsn;    // Position de block[0]
+    size_t block_len;
+    char block[READER_BLOCK];
+} JournalReader;
+
+// Agrégats des segments compactés (histo.agg), tenus par le fil de
+// compaction: ce que les transactions archivées ont fait à chaque vol et à
+// chaque agence. Sans point de reprise, les montants des agences
+// remplacent au démarrage le rejeu des segments archivés.
+typedef struct {
+    long long transactions;
+    long long booked;      // Places réservées
+    long long cancelled;   // Places annulées
+} FlightAggregate;
+
+typedef struct {
+    int id;
+    long long transactions;
+    long long cents;
+} AgencyAggregate;
+
+typedef struct {
+    uint64_t lsn;          // Fin des segments compactés (0: aucun)
+    FlightAggregate *flights; // Par index de vol
+    IntMap *agency_index;  // id -> emplacement dans agencies
+    AgencyAggregate *agencies;
+    int num_agencies;
+    int agencies_capacity;
+} Aggregates;
+
+Aggregates aggregates;
+
+// Places et totaux tels qu'ils étaient après la ligne du journal se
+// terminant à lsn. Le thread persistence_thread tient cette copie à jour en
+// relisant le journal, sans toucher à l'état partagé par les requêtes, et
+// s'en sert pour écrire checkpoint.txt, vols.txt et facture.txt hors du
+// chemin des requêtes. Les indicateurs *_dirty évitent de réécrire un
+// fichier que les dernières lignes n'ont pas modifié.
+typedef struct {
+    JournalReader journal; // Lecture du journal
+    uint64_t lsn;
+    int *seats;            // Places par index de vol
+    IntMap *agency_index;  // id -> emplacement dans agency_ids/agency_totals
+    int *agency_ids;
+    long long *agency_totals;
+    int num_agencies;
+    int agencies_capacity;
+    int seats_dirty;       // vols.txt (ou vols.bin) à mettre à jour
+    int totals_dirty;      // facture.txt à réécrire
+    uint64_t checkpoint_lsn; // Position couverte par checkpoint.txt
+    time_t checkpoint_time;
+} Checkpoint;
+
+Checkpoint checkpoint = { .checkpoint_lsn = UINT64_MAX };
+pthread_mutex_t persist_mutex = PTHREAD_MUTEX_INITIALIZER; // Protège checkpoint
+int checkpoint_interval = DEFAULT_CHECKPOINT_INTERVAL;
+int flush_interval_ms = DEFAULT_FLUSH_INTERVAL;
+uint64_t vols_lsn = 0; // Position du journal reflétée par les places de vols.txt
+int use_vols_bin = 0;          // Option -b: vols.bin au lieu de vols.txt
+VolsBinHeader *vols_bin = NULL; // vols.bin projeté en mémoire
+size_t vols_bin_size = 0;
+
+// Entrée de l'index de l'historique (histo.idx), une par ligne de histo.txt,
+// dans l'ordre du journal. Chacune pointe vers la précédente du même vol et
+// de la même agence: les transactions d'un vol ou d'une agence se lisent
+// sans parcourir le journal. Entiers dans l'ordre natif de la machine.
+typedef struct {
+    uint64_t lsn;          // Début de la ligne dans histo.txt
+    int64_t time;          // Horodatage (s), croissant; 0 pour les anciennes lignes
+    int32_t ref;
+    int32_t agency_id;
+    uint32_t prev_flight;  // Entrée précédente du même vol + 1 (0: aucune)
+    uint32_t prev_agency;  // Entrée précédente de la même agence + 1
+    uint32_t length;       // Longueur de la ligne, '\n' compris
+    uint32_t reserved;
+} HistoryEntry;
+
+// Dernière entrée (+ 1) de chaque vol ou de chaque agence
+typedef struct {
+    IntMap *index;         // Clé -> emplacement dans heads
+    uint32_t *heads[HISTORY_MAX_KEY_CHUNKS]; // Blocs jamais déplacés
+    int count;
+} HistoryKeys;
+
+// Index de l'historique. Seul le thread du journal y ajoute des entrées,
+// une fois leurs lignes écrites, puis publie count. Les entrées < count ne
+// changent plus: une requête HISTORY lit count une fois et travaille sur cet
+// instantané, sans verrou, pendant que les réservations continuent.
+typedef struct {
+    HistoryEntry *chunks[HISTORY_MAX_CHUNKS];
+    uint32_t count;
+    uint64_t end_lsn;      // Fin de la dernière ligne indexée
+    HistoryKeys flights;
+    HistoryKeys agencies;
+    int index_fd;          // histo.idx, en ajout (-1 après une erreur)
+    Buffer pending;        // Entrées pas encore écrites dans histo.idx
+} History;
+
+History history = { .index_fd = -1 };
+
+// Statistiques: chaque thread remplit ses propres histogrammes (en ns), sans
+// verrou ni instruction atomique coûteuse; STATS les additionne à la lecture.
+enum { CMD_RESERVE, CMD_CANCEL, CMD_INVOICE, CMD_CONSULT, CMD_CONSULT_SINCE, CMD_STATS,
+       CMD_HISTORY, CMD_SEARCH, CMD_HOLD, CMD_CONFIRM, CMD_RELEASE, CMD_RESERVE_BATCH, CMD_OTHER,
+       NUM_COMMANDS };
+const char *command_names[NUM_COMMANDS] = {
+    "RESERVE", "CANCEL", "INVOICE", "CONSULT", "CONSULT_SINCE", "STATS", "HISTORY", "SEARCH",
+    "HOLD", "CONFIRM", "RELEASE", "RESERVE_BATCH", "OTHER"
+};
+enum { LOCK_JOURNAL, LOCK_AGENCY, LOCK_CATALOGUE, LOCK_PERSIST, LOCK_HOLDS, NUM_LOCKS };
+const char *lock_names[NUM_LOCKS] = { "journal", "agency", "catalogue", "persist", "holds" };
+enum { IO_JOURNAL_WRITE, IO_JOURNAL_SYNC, IO_CHECKPOINT, IO_VOLS, IO_FACTURE, NUM_IO };
+const char *io_names[NUM_IO] = {
+    "journal_write", "journal_sync", "checkpoint", "vols", "facture"
+};
+
+typedef struct ThreadStats {
+    Histogram commands[NUM_COMMANDS]; // Temps de traitement des requêtes
+    Histogram durable_wait;           // Attente du journal avant de répondre
+    Histogram lock_wait[NUM_LOCKS];
+    Histogram lock_hold[NUM_LOCKS];
+    Histogram io[NUM_IO];             // Écritures et synchronisations disque
+    uint64_t journal_bytes;
+    uint64_t busy;                    // Requêtes refusées par le contrôle d'admission
+    uint64_t udp_replays;             // Datagrammes retransmis servis depuis le cache
+    struct ThreadStats *next;         // Liste de tous les threads
+} ThreadStats;
+
+// Chaque thread a ses statistiques (un seul écrivain, sans atomique
+// coûteux); la liste n'est jamais raccourcie
+ThreadStats *all_stats = NULL;
+pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER; // Protège all_stats
+__thread ThreadStats *my_stats = NULL;
+struct timespec start_time;
+int stats_interval = 0; // Secondes entre deux écritures de stats.txt (0: jamais)
+
+// Garantit la place pour extra octets supplémentaires (+ '\0')
+void buffer_reserve(Buffer *buf, size_t extra) {
+    if (buf->len + extra + 1 <= buf->cap) return;
+    size_t cap = buf->cap ? buf->cap : 256;
+    while (cap < buf->len + extra + 1) cap *= 2;
+    char *data = realloc(buf->data, cap);
+    if (!data) {
+        perror("Erreur d'allocation du tampon");
+        exit(EXIT_FAILURE);
+    }
+    buf->data = data;
+    buf->cap = cap;
+}
+
+void buffer_append(Buffer *buf, const char *data, size_t len) {
+    buffer_reserve(buf, len);
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    buf->data[buf->len] = '\0';
+}
+
+void buffer_printf(Buffer *buf, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (n < 0) return;
+    buffer_reserve(buf, n);
+    va_start(ap, fmt);
+    vsnprintf(buf->data + buf->len, n + 1, fmt, ap);
+    va_end(ap);
+    buf->len += n;
+}
+
+// Retire les n premiers octets du tampon
+void buffer_consume(Buffer *buf, size_t n) {
+    memmove(buf->data, buf->data + n, buf->len - n);
+    buf->len -= n;
+}
+
+void buffer_free(Buffer *buf) {
+    free(buf->data);
+    buf->data = NULL;
+    buf->len = buf->cap = 0;
+}
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Statistiques du thread courant, créées à sa première mesure
+ThreadStats *thread_stats() {
+    if (my_stats) return my_stats;
+    ThreadStats *stats = calloc(1, sizeof(ThreadStats));
+    if (!stats) {
+        perror("Erreur d'allocation des statistiques");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_lock(&stats_mutex);
+    stats->next = all_stats;
+    all_stats = stats;
+    pthread_mutex_unlock(&stats_mutex);
+    my_stats = stats;
+    return stats;
+}
+
+void stats_command(int command, uint64_t start) {
+    hist_add(&thread_stats()->commands[command], now_ns() - start);
+}
+
+void stats_io(int io, uint64_t start) {
+    hist_add(&thread_stats()->io[io], now_ns() - start);
+}
+
+// Prend un verrou en mesurant l'attente; renvoie l'instant d'acquisition
+// à passer à stats_unlock, qui mesure la durée de détention
+uint64_t stats_lock(pthread_mutex_t *mutex, int lock) {
+    uint64_t start = 0;
+    if (pthread_mutex_trylock(mutex) != 0) {
+        start = now_ns();
+        pthread_mutex_lock(mutex);
+    }
+    uint64_t acquired = now_ns();
+    hist_add(&thread_stats()->lock_wait[lock], start ? acquired - start : 0);
+    return acquired;
+}
+
+void stats_unlock(pthread_mutex_t *mutex, int lock, uint64_t acquired) {
+    hist_add(&thread_stats()->lock_hold[lock], now_ns() - acquired);
+    pthread_mutex_unlock(mutex);
+}
+
+// Une ligne "nom nombre p50 p99 p99.9 max" (µs) par histogramme non vide
+void stats_line(Buffer *out, const char *kind, const char *name, const Histogram *h) {
+    if (h->total == 0) return;
+    buffer_printf(out, "%s %s count=%llu p50_us=%.3f p99_us=%.3f p999_us=%.3f max_us=%.3f\n",
+                  kind, name, (unsigned long long)h->total,
+                  hist_percentile(h, 0.50) / 1000.0, hist_percentile(h, 0.99) / 1000.0,
+                  hist_percentile(h, 0.999) / 1000.0, h->max / 1000.0);
+}
+
+// Rapport de statistiques (commande STATS, console, stats.txt): une mesure
+// par ligne, sous forme "type nom clé=valeur..." facile à analyser
+void stats_report(Buffer *out) {
+    ThreadStats *total = calloc(1, sizeof(ThreadStats));
+    if (!total) return;
+    pthread_mutex_lock(&stats_mutex);
+    ThreadStats *first = all_stats;
+    pthread_mutex_unlock(&stats_mutex);
+    int count = 0;
+    for (ThreadStats *stats = first; stats; stats = stats->next, count++) {
+        for (int i = 0; i < NUM_COMMANDS; i++) hist_merge(&total->commands[i], &stats->commands[i]);
+        hist_merge(&total->durable_wait, &stats->durable_wait);
+        for (int i = 0; i < NUM_LOCKS; i++) {
+            hist_merge(&total->lock_wait[i], &stats->lock_wait[i]);
+            hist_merge(&total->lock_hold[i], &stats->lock_hold[i]);
+        }
+        for (int i = 0; i < NUM_IO; i++) hist_merge(&total->io[i], &stats->io[i]);
+        total->journal_bytes += __atomic_load_n(&stats->journal_bytes, __ATOMIC_RELAXED);
+        total->busy += __atomic_load_n(&stats->busy, __ATOMIC_RELAXED);
+        total->udp_replays += __atomic_load_n(&stats->udp_replays, __ATOMIC_RELAXED);
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double uptime = now.tv_sec - start_time.tv_sec + (now.tv_nsec - start_time.tv_nsec) / 1e9;
+    uint64_t requests = 0;
+    for (int i = 0; i < NUM_COMMANDS; i++) requests += total->commands[i].total;
+    buffer_printf(out, "server uptime_s=%.3f requests=%llu rate=%.1f threads=%d subscribers=%d"
+                  " holds=%d queue=%d busy=%llu\n", uptime, (unsigned long long)requests,
+                  uptime > 0 ? requests / uptime : 0.0, count,
+                  __atomic_load_n(&num_subscribers, __ATOMIC_RELAXED),
+                  __atomic_load_n(&active_holds, __ATOMIC_RELAXED),
+                  __atomic_load_n(&journal.queued, __ATOMIC_RELAXED),
+                  (unsigned long long)total->busy);
+    for (int i = 0; i < NUM_COMMANDS; i++) {
+        stats_line(out, "command", command_names[i], &total->commands[i]);
+    }
+    stats_line(out, "wait", "durable", &total->durable_wait);
+    for (int i = 0; i < NUM_LOCKS; i++) {
+        stats_line(out, "lock_wait", lock_names[i], &total->lock_wait[i]);
+        stats_line(out, "lock_hold", lock_names[i], &total->lock_hold[i]);
+    }
+    for (int i = 0; i < NUM_IO; i++) stats_line(out, "io", io_names[i], &total->io[i]);
+    buffer_printf(out, "journal bytes=%llu\n", (unsigned long long)total->journal_bytes);
+    pthread_rwlock_rdlock(&segments.lock);
+    buffer_printf(out, "journal segments=%d compacted_lsn=%llu\n", segments.count - segments.first,
+                  (unsigned long long)__atomic_load_n(&aggregates.lsn, __ATOMIC_ACQUIRE));
+    pthread_rwlock_unlock(&segments.lock);
+    buffer_printf(out, "udp replays=%llu\n", (unsigned long long)total->udp_replays);
+    if (primary_address) {
+        uint64_t applied = __atomic_load_n(&replica_lsn, __ATOMIC_RELAXED);
+        uint64_t primary = __atomic_load_n(&primary_lsn, __ATOMIC_RELAXED);
+        buffer_printf(out, "replica lsn=%llu primary_lsn=%llu lag_bytes=%llu\n",
+                      (unsigned long long)applied, (unsigned long long)primary,
+                      (unsigned long long)(primary > applied ? primary - applied : 0));
+    }
+    free(total);
+}
+
+// Mélange les bits d'une clé pour le sondage linéaire
+size_t hash_int(int key) {
+    unsigned int h = (unsigned int)key;
+    h ^= h >> 16;
+    h *= 0x7feb352d;
+    h ^= h >> 15;
+    h *= 0x846ca68b;
+    h ^= h >> 16;
+    return h;
+}
+
+IntMap *intmap_create(size_t capacity) {
+    size_t cap = 16;
+    while (cap < capacity * 2) cap *= 2; // Taux de remplissage <= 50%
+    IntMap *map = calloc(1, sizeof(IntMap));
+    if (map) {
+        map->keys = malloc(cap * sizeof(int));
+        map->slots = malloc(cap * sizeof(int));
+    }
+    if (!map || !map->keys || !map->slots) {
+        perror("Erreur d'allocation de la table de hachage");
+        exit(EXIT_FAILURE);
+    }
+    memset(map->slots, 0xff, cap * sizeof(int));
+    map->capacity = cap;
+    return map;
+}
+
+// Renvoie l'emplacement associé à key, ou -1
+int intmap_find(const IntMap *map, int key) {
+    size_t mask = map->capacity - 1;
+    for (size_t i = hash_int(key) & mask;; i = (i + 1) & mask) {
+        int slot = __atomic_load_n(&map->slots[i], __ATOMIC_ACQUIRE);
+        if (slot == -1) return -1;
+        if (map->keys[i] == key) return slot;
+    }
+}
+
+// Insère key -> slot (key absente); la table ne doit pas être pleine
+void intmap_put(IntMap *map, int key, int slot) {
+    size_t mask = map->capacity - 1;
+    size_t i = hash_int(key) & mask;
+    while (map->slots[i] != -1) i = (i + 1) & mask;
+    map->keys[i] = key;
+    __atomic_store_n(&map->slots[i], slot, __ATOMIC_RELEASE);
+    map->count++;
+}
+
+// Copie la table dans une table deux fois plus grande
+IntMap *intmap_grow(const IntMap *map) {
+    IntMap *bigger = intmap_create(map->capacity);
+    for (size_t i = 0; i < map->capacity; i++) {
+        if (map->slots[i] != -1) intmap_put(bigger, map->keys[i], map->slots[i]);
+    }
+    return bigger;
+}
+
+// Trouve l'index d'un vol par sa référence (table de hachage, O(1))
+int find_flight_index(int ref) {
+    return intmap_find(flight_index, ref);
+}
+
+void intmap_free(IntMap *map) {
+    free(map->keys);
+    free(map->slots);
+    free(map);
+}
+
+// Ajoute un vol à la table, en l'agrandissant au besoin
+void add_flight(const Flight *flight) {
+    if (find_flight_index(flight->ref) != -1) {
+        printf("Vol %d en double dans vols.txt, ignoré\n", flight->ref);
+        return;
+    }
+    if (num_flights == flights_capacity) {
+        int capacity = flights_capacity ? flights_capacity * 2 : 128;
+        Flight *bigger = realloc(flights, capacity * sizeof(Flight));
+        uint64_t *versions = realloc(flight_versions, capacity * sizeof(uint64_t));
+        if (!bigger || !versions) {
+            perror("Erreur d'allocation de la table des vols");
+            exit(EXIT_FAILURE);
+        }
+        flights = bigger;
+        flight_versions = versions;
+        flights_capacity = capacity;
+    }
+    if ((flight_index->count + 1) * 2 > flight_index->capacity) {
+        IntMap *old = flight_index;
+        flight_index = intmap_grow(old);
+        intmap_free(old);
+    }
+    flights[num_flights] = *flight;
+    flight_versions[num_flights] = 0;
+    intmap_put(flight_index, flight->ref, num_flights);
+    num_flights++;
+}
+
+// Projette vols.bin en mémoire et charge ses enregistrements, sans analyse
+// de texte. Les enregistrements suivent l'ordre de la table des vols.
+void load_flights_bin() {
+    int fd = open("vols.bin", O_RDWR);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror("Erreur lors de l'ouverture de vols.bin (voir volsbin import)");
+        exit(EXIT_FAILURE);
+    }
+    if ((size_t)st.st_size < sizeof(VolsBinHeader)) {
+        fprintf(stderr, "vols.bin invalide\n");
+        exit(EXIT_FAILURE);
+    }
+    vols_bin_size = st.st_size;
+    vols_bin = mmap(NULL, vols_bin_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (vols_bin == MAP_FAILED) {
+        perror("Erreur lors de la projection de vols.bin");
+        exit(EXIT_FAILURE);
+    }
+    close(fd); // La projection reste valide
+    if (memcmp(vols_bin->magic, VOLSBIN_MAGIC, sizeof(vols_bin->magic)) != 0 ||
+        vols_bin->record_size != sizeof(VolsBinRecord) || vols_bin->active > 1 ||
+        vols_bin_size != sizeof(VolsBinHeader) + vols_bin->count * sizeof(VolsBinRecord)) {
+        fprintf(stderr, "vols.bin invalide\n");
+        exit(EXIT_FAILURE);
+    }
+
+    VolsBinRecord *records = (VolsBinRecord *)(vols_bin + 1);
+    int active = vols_bin->active;
+    flight_index = intmap_create(vols_bin->count);
+    for (uint64_t i = 0; i < vols_bin->count; i++) {
+        if (find_flight_index(records[i].ref) != -1) {
+            fprintf(stderr, "Vol %d en double dans vols.bin\n", records[i].ref);
+            exit(EXIT_FAILURE);
+        }
+        Flight flight = {0};
+        flight.ref = records[i].ref;
+        memcpy(flight.destination, records[i].destination, sizeof(flight.destination) - 1);
+        flight.available_seats = records[i].seats[active];
+        flight.price = records[i].price;
+        add_flight(&flight);
+    }
+    vols_lsn = vols_bin->lsn[active];
+    printf("Vols chargés depuis vols.bin: %d\n", num_flights);
+}
+
+// Charge les vols depuis vols.txt (ou vols.bin avec l'option -b)
+void load_flights() {
+    agency_index = intmap_create(1024);
+    if (use_vols_bin) {
+        load_flights_bin();
+        return;
+    }
+    FILE *fp = fopen("vols.txt", "r");
+    if (!fp) {
+        perror("Erreur lors de l'ouverture de vols.txt");
+        exit(EXIT_FAILURE);
+    }
+    flight_index = intmap_create(1024);
+    char line[256];
+    while (fgets(line, sizeof(line), fp)) {
+        unsigned long long lsn;
+        if (sscanf(line, "# histo.txt %llu", &lsn) == 1) {
+            vols_lsn = lsn; // vols.txt réécrit par le serveur
+            continue;
+        }
+        Flight flight = {0};
+        if (sscanf(line, "%d %49s %d %d", &flight.ref, flight.destination,
+                   &flight.available_seats, &flight.price) != 4) {
+            continue; // Ligne vide ou mal formée
+        }
+        add_flight(&flight);
+    }
+    fclose(fp);
+    printf("Vols chargés: %d\n", num_flights);
+}
+
+// Trouve l'agence id sans la créer (NULL si elle n'a aucune transaction)
+Agency *find_agency(int id) {
+    IntMap *index = __atomic_load_n(&agency_index, __ATOMIC_ACQUIRE);
+    int slot = intmap_find(index, id);
+    if (slot == -1) return NULL;
+    return &agency_chunks[slot / AGENCY_CHUNK_SIZE][slot % AGENCY_CHUNK_SIZE];
+}
+
+// Trouve l'agence id, en la créant si nécessaire (NULL si la table est pleine).
+// Les anciennes tables d'index ne sont jamais libérées: un lecteur qui en
+// tient encore une y trouve des emplacements toujours valides.
+Agency *get_agency(int id) {
+    Agency *agency = find_agency(id);
+    if (agency) return agency;
+
+    uint64_t locked = stats_lock(&agency_mutex, LOCK_AGENCY);
+    agency = find_agency(id); // Créée entre-temps par un autre thread ?
+    if (!agency && num_agencies < AGENCY_CHUNK_SIZE * AGENCY_MAX_CHUNKS) {
+        int slot = num_agencies;
+        Agency **chunk = &agency_chunks[slot / AGENCY_CHUNK_SIZE];
+        if (!*chunk) *chunk = calloc(AGENCY_CHUNK_SIZE, sizeof(Agency));
+        if (*chunk) {
+            agency = &(*chunk)[slot % AGENCY_CHUNK_SIZE];
+            agency->id = id;
+            if ((agency_index->count + 1) * 2 > agency_index->capacity) {
+                __atomic_store_n(&agency_index, intmap_grow(agency_index), __ATOMIC_RELEASE);
+            }
+            intmap_put(agency_index, id, slot);
+            __atomic_store_n(&num_agencies, num_agencies + 1, __ATOMIC_RELEASE);
+        }
+    }
+    stats_unlock(&agency_mutex, LOCK_AGENCY, locked);
+    return agency;
+}
+
+// Montant facturé pour value places, en centimes
+long long reserve_cost(const Flight *flight, int value) {
+    return (long long)value * flight->price * 100;
+}
+
+// Montant remboursé (90%) pour value places annulées, en centimes
+long long cancel_refund(const Flight *flight, int value) {
+    return (long long)value * flight->price * 90;
+}
+
+// Synchronise un répertoire (après un renommage ou une création)
+void sync_directory(const char *path) {
+    int dir = open(path, O_RDONLY);
+    if (dir >= 0) {
+        fsync(dir);
+        close(dir);
+    }
+}
+
+// Ouvre path.tmp en écriture; à terminer par commit_file
+FILE *open_temp_file(const char *path, char *tmp_path, size_t size) {
+    snprintf(tmp_path, size, "%s.tmp", path);
+    FILE *fp = fopen(tmp_path, "w");
+    if (!fp) {
+        fprintf(stderr, "Erreur lors de l'ouverture de %s: %s\n", tmp_path, strerror(errno));
+    }
+    return fp;
+}
+
+// Synchronise le fichier temporaire puis le renomme (remplacement atomique).
+// Renvoie -1 en cas d'erreur (path n'a pas changé).
+int commit_file(FILE *fp, const char *tmp_path, const char *path) {
+    if (fflush(fp) != 0 || fsync(fileno(fp)) < 0) {
+        fprintf(stderr, "Erreur lors de l'écriture de %s: %s\n", tmp_path, strerror(errno));
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+    if (rename(tmp_path, path) < 0) {
+        fprintf(stderr, "Erreur lors du renommage de %s: %s\n", tmp_path, strerror(errno));
+        return -1;
+    }
+    sync_directory(".");
+    return 0;
+}
+
+// Réserve dans version.txt les versions jusqu'à la dernière attribuée +
+// VERSION_LEASE: au redémarrage, les versions reprennent au-delà de toutes
+// celles déjà attribuées, sans dépendre du journal (les blocages n'y
+// écrivent rien). Appelée au démarrage, puis par le fil de persistance dès
+// que la moitié de la réservation est consommée: aucune requête n'attend
+// d'écriture de version.txt. Seul un arrêt brutal après plus d'une demi
+// réservation de versions attribuées en un renouvellement pourrait en
+// faire réutiliser.
+void reserve_versions() {
+    uint64_t version = __atomic_load_n(&next_version, __ATOMIC_ACQUIRE);
+    if (version < __atomic_load_n(&version_low_water, __ATOMIC_ACQUIRE)) return;
+    uint64_t limit = version + VERSION_LEASE;
+    char tmp[64];
+    FILE *fp = open_temp_file("version.txt", tmp, sizeof(tmp));
+    if (!fp) exit(EXIT_FAILURE);
+    fprintf(fp, "VERSION %llu\n", (unsigned long long)limit);
+    if (commit_file(fp, tmp, "version.txt") < 0) exit(EXIT_FAILURE);
+    __atomic_store_n(&version_low_water, limit - VERSION_LEASE / 2, __ATOMIC_RELEASE);
+}
+
+// Version de départ: la limite réservée par l'exécution précédente
+uint64_t load_version_base() {
+    FILE *fp = fopen("version.txt", "r");
+    if (!fp) return 0;
+    unsigned long long base = 0;
+    if (fscanf(fp, "VERSION %llu", &base) != 1) {
+        printf("version.txt illisible, ignoré\n");
+        base = 0;
+    }
+    fclose(fp);
+    return base;
+}
+
+int get_seats(Flight *flight) {
+    return __atomic_load_n(&flight->available_seats, __ATOMIC_ACQUIRE);
+}
+
+VersionWriter *version_writer() {
+    if (my_version_writer) return my_version_writer;
+    VersionWriter *writer = calloc(1, sizeof(VersionWriter));
+    if (!writer) {
+        perror("Erreur d'allocation d'un écrivain de versions");
+        exit(EXIT_FAILURE);
+    }
+    writer->next = __atomic_load_n(&version_writers, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&version_writers, &writer->next, writer, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    my_version_writer = writer;
+    return writer;
+}
+
+// Version publiée: la plus grande version v telle que chaque vol modifié
+// par une version <= v porte déjà sa version, si bien qu'un CONSULT_SINCE
+// ne peut pas manquer de changement. C'est la dernière version attribuée,
+// abaissée sous celles que des écrivains sont encore en train de marquer:
+// un écrivain interrompu retarde la version vue par les lecteurs, jamais
+// les autres écrivains.
+uint64_t published_version() {
+    uint64_t version = __atomic_load_n(&next_version, __ATOMIC_SEQ_CST);
+    for (VersionWriter *w = __atomic_load_n(&version_writers, __ATOMIC_ACQUIRE); w; w = w->next) {
+        uint64_t pending = __atomic_load_n(&w->pending, __ATOMIC_SEQ_CST);
+        if (pending > 0 && pending - 1 < version) version = pending - 1;
+    }
+    return version;
+}
+
+// Marque un vol comme modifié dans une nouvelle version du catalogue
+void touch_flight(Flight *flight) {
+    VersionWriter *writer = version_writer();
+    uint64_t *slot = &flight_versions[flight - flights];
+    // Annoncée avant l'attribution: un lecteur qui voit la nouvelle version
+    // voit aussi cette borne, ou la fin du marquage
+    __atomic_store_n(&writer->pending, __atomic_load_n(&next_version, __ATOMIC_SEQ_CST) + 1,
+                     __ATOMIC_SEQ_CST);
+    uint64_t version = __atomic_add_fetch(&next_version, 1, __ATOMIC_SEQ_CST);
+    // Moitié de la réservation consommée: le fil de persistance la renouvelle
+    if (version >= __atomic_load_n(&version_low_water, __ATOMIC_RELAXED) &&
+        !__atomic_exchange_n(&version_renew_wanted, 1, __ATOMIC_ACQ_REL)) {
+        pthread_mutex_lock(&version_mutex);
+        pthread_cond_signal(&version_cond);
+        pthread_mutex_unlock(&version_mutex);
+    }
+    __atomic_store_n(&change_ring[version & (CHANGE_RING_SIZE - 1)], (int)(flight - flights),
+                     __ATOMIC_RELAXED);
+    uint64_t current = __atomic_load_n(slot, __ATOMIC_RELAXED);
+    while (current < version &&
+           !__atomic_compare_exchange_n(slot, &current, version, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    __atomic_store_n(&writer->pending, 0, __ATOMIC_SEQ_CST);
+    // Réveil après la fin du marquage: le thread de notification relit la
+    // version publiée après avoir remis notify_pending à 0
+    if (__atomic_load_n(&num_subscribers, __ATOMIC_RELAXED) > 0 &&
+        !__atomic_exchange_n(&notify_pending, 1, __ATOMIC_SEQ_CST)) {
+        uint64_t one = 1;
+        if (write(notify_fd, &one, sizeof(one)) < 0) {
+            __atomic_store_n(&notify_pending, 0, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+// Retire value places si elles sont disponibles (compare-and-swap sans verrou)
+int try_reserve_seats(Flight *flight, int value) {
+    int seats = get_seats(flight);
+    do {
+        if (seats < value) return 0;
+    } while (!__atomic_compare_exchange_n(&flight->available_seats, &seats, seats - value,
+                                          1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    touch_flight(flight);
+    return 1;
+}
+
+void add_seats(Flight *flight, int value) {
+    __atomic_fetch_add(&flight->available_seats, value, __ATOMIC_ACQ_REL);
+    touch_flight(flight);
+}
+
+void add_payment(Agency *agency, long long cents) {
+    __atomic_fetch_add(&agency->total_payments, cents, __ATOMIC_RELAXED);
+}
+
+double get_payment(int agency_id) {
+    Agency *agency = find_agency(agency_id);
+    if (!agency) return 0;
+    return __atomic_load_n(&agency->total_payments, __ATOMIC_RELAXED) / 100.0;
+}
+
+// Contrôle d'admission, avant toute modification: ST_READ_ONLY sur une
+// réplique, ST_BUSY si le journal a
+// déjà max_queue lignes à acquitter (la réponse attendrait d'autant plus)
+// ou si l'agence dépasse agency_rate requêtes par seconde. Le refus est
+// immédiat et ne laisse aucune trace. Le débit suit l'algorithme GCRA: une
+// seule date par agence, avancée par compare-and-swap, qui autorise une
+// rafale d'une seconde de requêtes.
+int admit(Agency *agency) {
+    if (primary_address) return ST_READ_ONLY; // Réplique: les écritures vont au primaire
+    if (max_queue > 0 && __atomic_load_n(&journal.queued, __ATOMIC_RELAXED) >= max_queue) {
+        thread_stats()->busy++;
+        return ST_BUSY;
+    }
+    if (agency && agency_rate > 0) {
+        uint64_t now = now_ns(), interval = 1000000000ULL / agency_rate;
+        uint64_t tat = __atomic_load_n(&agency->rate_tat, __ATOMIC_RELAXED), next;
+        do {
+            next = (tat > now ? tat : now) + interval;
+            if (next - now > 1000000000ULL) {
+                thread_stats()->busy++;
+                return ST_BUSY;
+            }
+        } while (!__atomic_compare_exchange_n(&agency->rate_tat, &tat, next, 1,
+                                              __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    }
+    return ST_SUCCESS;
+}
+
+// Ligne de histo.txt: "ref agence transaction places résultat heure".
+// Un lot RESERVE_BATCH tient sur une seule ligne, les références et les
+// places de chaque vol séparées par des virgules:
+// "ref1,ref2 agence Lot places1,places2 résultat heure".
+typedef struct {
+    int legs;
+    int refs[MAX_BATCH_LEGS];
+    int values[MAX_BATCH_LEGS];
+    int agency_id;
+    char transaction[20];
+    char result[20];
+    long long time; // 0 pour les lignes écrites avant l'horodatage
+} JournalRecord;
+
+// Lit une liste "n1,n2,..." à *p; renvoie le nombre d'entiers lus (0: erreur)
+int parse_journal_list(const char **p, int *values) {
+    int count = 0;
+    while (count < MAX_BATCH_LEGS) {
+        char *end;
+        long value = strtol(*p, &end, 10);
+        if (end == *p) return 0;
+        values[count++] = value;
+        *p = end;
+        if (**p != ',') return count;
+        (*p)++;
+    }
+    return 0; // Trop de vols
+}
+
+int parse_journal_line(const char *line, JournalRecord *rec) {
+    const char *p = line;
+    int used;
+    rec->time = 0;
+    rec->legs = parse_journal_list(&p, rec->refs);
+    if (rec->legs == 0 ||
+        sscanf(p, " %d %19s %n", &rec->agency_id, rec->transaction, &used) != 2) {
+        return 0;
+    }
+    p += used;
+    if (parse_journal_list(&p, rec->values) != rec->legs) return 0;
+    return sscanf(p, " %19s %lld", rec->result, &rec->time) >= 1;
+}
+
+// Décode une ligne de histo.txt en variations de places et de paiement, une
+// par vol concerné (plusieurs pour un lot). Remplit flight_idx, seats et
+// cents (MAX_BATCH_LEGS cases) et renvoie leur nombre, 0 si la ligne est
+// sans effet.
+int parse_history_line(const char *line, int *agency_id, int *flight_idx, int *seats,
+                       long long *cents) {
+    JournalRecord rec;
+    if (!parse_journal_line(line, &rec)) return 0;
+    int booked = (strcmp(rec.transaction, "Demande") == 0 || strcmp(rec.transaction, "Lot") == 0) &&
+                 strcmp(rec.result, "succès") == 0;
+    int cancelled = strcmp(rec.transaction, "Annulation") == 0;
+    if (!booked && !cancelled) return 0;
+    *agency_id = rec.agency_id;
+    int count = 0;
+    for (int i = 0; i < rec.legs; i++) {
+        int idx = find_flight_index(rec.refs[i]);
+        if (idx == -1) continue;
+        flight_idx[count] = idx;
+        seats[count] = booked ? -rec.values[i] : rec.values[i];
+        cents[count] = booked ? reserve_cost(&flights[idx], rec.values[i])
+                              : -cancel_refund(&flights[idx], rec.values[i]);
+        count++;
+    }
+    return count;
+}
+
+void segment_path(char *path, size_t size, uint64_t start) {
+    snprintf(path, size, "histo-%012llu.txt", (unsigned long long)start);
+}
+
+// Déplace un segment compacté dans archive/ (conservé pour audit)
+void archive_segment(const char *path) {
+    char archived[128];
+    snprintf(archived, sizeof(archived), "archive/%s", path);
+    if ((mkdir("archive", 0755) < 0 && errno != EEXIST) || rename(path, archived) < 0) {
+        fprintf(stderr, "Erreur lors de l'archivage de %s: %s\n", path, strerror(errno));
+    }
+}
+
+void segment_add(uint64_t start, uint64_t end, int fd) {
+    pthread_rwlock_wrlock(&segments.lock);
+    Segment *seg = &segments.list[segments.count];
+    seg->start = start;
+    seg->end = end;
+    seg->fd = fd;
+    segments.count++;
+    pthread_rwlock_unlock(&segments.lock);
+}
+
+// Fin des données écrites dans le journal
+uint64_t journal_end() {
+    pthread_rwlock_rdlock(&segments.lock);
+    uint64_t end = __atomic_load_n(&segments.list[segments.count - 1].end, __ATOMIC_ACQUIRE);
+    pthread_rwlock_unlock(&segments.lock);
+    return end;
+}
+
+int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Ouvre les segments du journal (après histo.agg): les segments scellés
+// dans l'ordre, puis histo.txt. Un segment déjà couvert par histo.agg
+// (arrêt au milieu d'une compaction) finit d'être archivé.
+void segments_open() {
+    DIR *dir = opendir(".");
+    if (!dir) {
+        perror("Erreur lors de la lecture du répertoire");
+        exit(EXIT_FAILURE);
+    }
+    uint64_t *starts = NULL;
+    size_t count = 0, capacity = 0;
+    struct dirent *ent;
+    while ((ent = readdir(dir))) {
+        unsigned long long start;
+        int used = 0;
+        if (sscanf(ent->d_name, "histo-%llu.txt%n", &start, &used) != 1 || used == 0 ||
+            ent->d_name[used] != '\0') {
+            continue;
+        }
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            starts = realloc(starts, capacity * sizeof(uint64_t));
+            if (!starts) {
+                perror("Erreur d'allocation des segments du journal");
+                exit(EXIT_FAILURE);
+            }
+        }
+        starts[count++] = start;
+    }
+    closedir(dir);
+    qsort(starts, count, sizeof(uint64_t), compare_u64);
+    if (count >= MAX_SEGMENTS) {
+        fprintf(stderr, "Trop de segments du journal (%zu)\n", count);
+        exit(EXIT_FAILURE);
+    }
+
+    uint64_t expected = aggregates.lsn;
+    int archived = 0;
+    for (size_t i = 0; i < count; i++) {
+        char path[64];
+        struct stat st;
+        segment_path(path, sizeof(path), starts[i]);
+        int fd = open(path, O_RDONLY);
+        if (fd < 0 || fstat(fd, &st) < 0) {
+            perror("Erreur lors de l'ouverture d'un segment du journal");
+            exit(EXIT_FAILURE);
+        }
+        if (starts[i] + st.st_size <= aggregates.lsn) {
+            close(fd);
+            archive_segment(path);
+            archived++;
+            continue;
+        }
+        if (starts[i] != expected) {
+            fprintf(stderr, "Segment du journal manquant entre les octets %llu et %llu\n",
+                    (unsigned long long)expected, (unsigned long long)starts[i]);
+            exit(EXIT_FAILURE);
+        }
+        segment_add(starts[i], starts[i] + st.st_size, fd);
+        expected = starts[i] + st.st_size;
+    }
+    free(starts);
+    if (archived > 0) {
+        sync_directory("archive");
+        sync_directory(".");
+    }
+
+    int fd = open("histo.txt", O_RDONLY | O_CREAT, 0644);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror("Erreur lors de l'ouverture de histo.txt");
+        exit(EXIT_FAILURE);
+    }
+    segment_add(expected, expected + st.st_size, fd);
+    if (segments.count > 1) {
+        printf("Journal: %d segment(s) scellé(s), histo.txt à partir de l'octet %llu\n",
+               segments.count - 1, (unsigned long long)expected);
+    }
+}
+
+// Segment contenant la position lsn (verrou des segments pris), -1 si elle
+// est compactée ou au-delà de la fin
+int segment_find(uint64_t lsn) {
+    int low = segments.first, high = segments.count; // Premier segment commençant après lsn
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (segments.list[mid].start <= lsn) low = mid + 1;
+        else high = mid;
+    }
+    if (low == segments.first) return -1;
+    return lsn < __atomic_load_n(&segments.list[low - 1].end, __ATOMIC_ACQUIRE) ? low - 1 : -1;
+}
+
+// Lit au plus size octets du journal à partir de lsn, sans dépasser la fin
+// de son segment (une ligne n'est jamais à cheval sur deux). Renvoie le
+// nombre d'octets lus, 0 si lsn est compactée ou au-delà de la fin.
+ssize_t journal_pread(char *data, size_t size, uint64_t lsn) {
+    ssize_t n = 0;
+    pthread_rwlock_rdlock(&segments.lock);
+    int i = segment_find(lsn);
+    if (i >= 0) {
+        Segment *seg = &segments.list[i];
+        uint64_t end = __atomic_load_n(&seg->end, __ATOMIC_ACQUIRE);
+        if (size > end - lsn) size = end - lsn;
+        n = pread(seg->fd, data, size, lsn - seg->start);
+    }
+    pthread_rwlock_unlock(&segments.lock);
+    return n;
+}
+
+// Copie dans line (size octets, '\0' final) la ligne commençant à
+// reader->lsn, sans lire au-delà de end, et passe à la suivante. Renvoie sa
+// longueur dans le journal ('\n' compris), 0 à la fin.
+size_t journal_next_line(JournalReader *reader, uint64_t end, char *line, size_t size) {
+    if (reader->lsn >= end) return 0;
+    size_t offset = reader->lsn - reader->block_lsn;
+    const char *newline = NULL;
+    if (reader->lsn < reader->block_lsn || offset >= reader->block_len ||
+        !(newline = memchr(reader->block + offset, '\n', reader->block_len - offset))) {
+        size_t want = end - reader->lsn < READER_BLOCK ? end - reader->lsn : READER_BLOCK;
+        ssize_t n = journal_pread(reader->block, want, reader->lsn);
+        if (n <= 0) return 0;
+        reader->block_lsn = reader->lsn;
+        reader->block_len = n;
+        offset = 0;
+        newline = memchr(reader->block, '\n', n);
+    }
+    // Sans '\n': dernière ligne inachevée du segment (ou plus longue qu'un bloc)
+    size_t length = newline ? (size_t)(newline - reader->block) + 1 - offset
+                            : reader->block_len - offset;
+    size_t copied = length < size ? length : size - 1;
+    memcpy(line, reader->block + offset, copied);
+    line[copied] = '\0';
+    reader->lsn += length;
+    return length;
+}
+
+// Synchronise le segment actif (les segments scellés le sont déjà)
+void journal_sync() {
+    pthread_rwlock_rdlock(&segments.lock);
+    fdatasync(segments.list[segments.count - 1].fd);
+    pthread_rwlock_unlock(&segments.lock);
+}
+
+// Agrégat de l'agence id, créé si nécessaire
+AgencyAggregate *aggregate_agency(int id) {
+    int slot = intmap_find(aggregates.agency_index, id);
+    if (slot == -1) {
+        if (aggregates.num_agencies == aggregates.agencies_capacity) {
+            int capacity = aggregates.agencies_capacity ? aggregates.agencies_capacity * 2 : 1024;
+            AgencyAggregate *agencies = realloc(aggregates.agencies, capacity * sizeof(AgencyAggregate));
+            if (!agencies) {
+                perror("Erreur d'allocation des agrégats");
+                exit(EXIT_FAILURE);
+            }
+            aggregates.agencies = agencies;
+            aggregates.agencies_capacity = capacity;
+        }
+        if ((aggregates.agency_index->count + 1) * 2 > aggregates.agency_index->capacity) {
+            IntMap *old = aggregates.agency_index;
+            aggregates.agency_index = intmap_grow(old);
+            intmap_free(old);
+        }
+        slot = aggregates.num_agencies++;
+        memset(&aggregates.agencies[slot], 0, sizeof(AgencyAggregate));
+        aggregates.agencies[slot].id = id;
+        intmap_put(aggregates.agency_index, id, slot);
+    }
+    return &aggregates.agencies[slot];
+}
+
+// Ajoute une ligne de histo.txt aux agrégats
+void aggregate_line(const char *line) {
+    int agency_id, flight_idx[MAX_BATCH_LEGS], seats[MAX_BATCH_LEGS];
+    long long cents[MAX_BATCH_LEGS];
+    int legs = parse_history_line(line, &agency_id, flight_idx, seats, cents);
+    if (legs == 0) return;
+    AgencyAggregate *agency = aggregate_agency(agency_id);
+    agency->transactions++;
+    for (int i = 0; i < legs; i++) {
+        FlightAggregate *flight = &aggregates.flights[flight_idx[i]];
+        flight->transactions++;
+        if (seats[i] < 0) flight->booked -= seats[i];
+        else flight->cancelled += seats[i];
+        agency->cents += cents[i];
+    }
+}
+
+// Charge histo.agg s'il existe (après les vols). Sans lui, les segments
+// archivés manqueraient au rejeu: un fichier illisible arrête le serveur.
+void load_aggregates() {
+    aggregates.flights = calloc(num_flights ? num_flights : 1, sizeof(FlightAggregate));
+    aggregates.agency_index = intmap_create(1024);
+    if (!aggregates.flights) {
+        perror("Erreur d'allocation des agrégats");
+        exit(EXIT_FAILURE);
+    }
+    FILE *fp = fopen("histo.agg", "r");
+    if (!fp) return;
+    char line[256];
+    unsigned long long lsn;
+    if (!fgets(line, sizeof(line), fp) || sscanf(line, "AGREGATS %llu", &lsn) != 1) {
+        fprintf(stderr, "histo.agg illisible\n");
+        exit(EXIT_FAILURE);
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        int ref, agency_id;
+        long long transactions, booked, cancelled, cents;
+        if (sscanf(line, "VOL %d %lld %lld %lld", &ref, &transactions, &booked, &cancelled) == 4) {
+            int i = find_flight_index(ref);
+            if (i == -1) continue; // Vol retiré du catalogue
+            aggregates.flights[i].transactions += transactions;
+            aggregates.flights[i].booked += booked;
+            aggregates.flights[i].cancelled += cancelled;
+        } else if (sscanf(line, "AGENCE %d %lld %lld", &agency_id, &transactions, &cents) == 3) {
+            AgencyAggregate *agency = aggregate_agency(agency_id);
+            agency->transactions += transactions;
+            agency->cents += cents;
+        }
+    }
+    fclose(fp);
+    aggregates.lsn = lsn;
+    printf("histo.agg chargé (segments compactés jusqu'à l'octet %llu)\n", lsn);
+}
+
+// Sans point de reprise: les totaux des agences repartent des agrégats
+// des segments archivés
+void replay_aggregates() {
+    for (int i = 0; i < aggregates.num_agencies; i++) {
+        Agency *agency = get_agency(aggregates.agencies[i].id);
+        if (agency) add_payment(agency, aggregates.agencies[i].cents);
+    }
+}
+
+// Tâche du rejeu: les lignes qui commencent dans [start, end) d'un segment
+// projeté en mémoire (data, à partir de la position base, jusqu'à limit)
+typedef struct {
+    const char *data;
+    uint64_t base;
+    uint64_t start;
+    uint64_t end;
+    uint64_t limit;
+    int aligned;           // start est un début de ligne
+} ReplayTask;
+
+// Rejeu en parallèle: les fils prennent les tâches à tour de rôle et
+// cumulent chacun leurs variations de places (les totaux des agences sont
+// déjà atomiques); elles sont additionnées à la fin, l'ordre n'y change rien
+typedef struct {
+    ReplayTask *tasks;
+    int num_tasks;
+    int next;
+    uint64_t seats_from;
+} Replay;
+
+typedef struct {
+    int *seats;            // Variations de places par index de vol
+    int replayed;
+} ReplayWorker;
+
+Replay replay;
+
+void* replay_worker(void* arg) {
+    ReplayWorker *worker = arg;
+    char line[JOURNAL_LINE_MAX];
+    int t;
+    while ((t = __atomic_fetch_add(&replay.next, 1, __ATOMIC_RELAXED)) < replay.num_tasks) {
+        ReplayTask *task = &replay.tasks[t];
+        const char *p = task->data + (task->start - task->base);
+        const char *end = task->data + (task->end - task->base);
+        const char *limit = task->data + (task->limit - task->base);
+        if (!task->aligned && p[-1] != '\n') {
+            // La ligne coupée par le début de la tâche revient à la précédente
+            const char *newline = memchr(p, '\n', limit - p);
+            p = newline ? newline + 1 : limit;
+        }
+        while (p < end) {
+            const char *newline = memchr(p, '\n', limit - p);
+            size_t length = newline ? (size_t)(newline - p) + 1 : (size_t)(limit - p);
+            size_t copied = length < sizeof(line) ? length : sizeof(line) - 1;
+            memcpy(line, p, copied);
+            line[copied] = '\0';
+            int agency_id, flight_idx[MAX_BATCH_LEGS], seats[MAX_BATCH_LEGS];
+            long long cents[MAX_BATCH_LEGS];
+            int legs = parse_history_line(line, &agency_id, flight_idx, seats, cents);
+            Agency *agency = legs > 0 ? get_agency(agency_id) : NULL;
+            uint64_t pos = task->base + (p - task->data);
+            for (int i = 0; agency && i < legs; i++) {
+                if (pos >= replay.seats_from) worker->seats[flight_idx[i]] += seats[i];
+                add_payment(agency, cents[i]);
+            }
+            worker->replayed++;
+            p += length;
+        }
+    }
+    return NULL;
+}
+
+// Rejoue les transactions historiques du journal, à partir de l'offset
+// from (fin de la partie déjà couverte par le point de reprise ou par
+// histo.agg). Les lignes avant seats_from sont déjà comptées dans les
+// places lues dans vols.txt: seuls leurs paiements sont rejoués. Chaque
+// segment est projeté en mémoire et découpé en tâches de REPLAY_CHUNK
+// octets, réparties sur les cœurs.
+void replay_history(uint64_t from, uint64_t seats_from) {
+    int first = segments.first;
+    while (first < segments.count && segments.list[first].end <= from) first++;
+    int num_tasks = 0;
+    for (int i = first; i < segments.count; i++) {
+        uint64_t start = from > segments.list[i].start ? from : segments.list[i].start;
+        num_tasks += (segments.list[i].end - start + REPLAY_CHUNK - 1) / REPLAY_CHUNK;
+    }
+    replay.tasks = calloc(num_tasks ? num_tasks : 1, sizeof(ReplayTask));
+    char **maps = calloc(segments.count, sizeof(char *));
+    if (!replay.tasks || !maps) {
+        perror("Erreur d'allocation du rejeu");
+        exit(EXIT_FAILURE);
+    }
+    replay.num_tasks = 0;
+    replay.next = 0;
+    replay.seats_from = seats_from;
+    for (int i = first; i < segments.count; i++) {
+        Segment *seg = &segments.list[i];
+        if (seg->end == seg->start) continue;
+        maps[i] = mmap(NULL, seg->end - seg->start, PROT_READ, MAP_PRIVATE, seg->fd, 0);
+        if (maps[i] == MAP_FAILED) {
+            perror("Erreur lors de la projection du journal");
+            exit(EXIT_FAILURE);
+        }
+        madvise(maps[i], seg->end - seg->start, MADV_SEQUENTIAL);
+        uint64_t start = from > seg->start ? from : seg->start;
+        for (uint64_t pos = start; pos < seg->end; pos += REPLAY_CHUNK) {
+            ReplayTask *task = &replay.tasks[replay.num_tasks++];
+            task->data = maps[i];
+            task->base = seg->start;
+            task->start = pos;
+            task->end = seg->end - pos < REPLAY_CHUNK ? seg->end : pos + REPLAY_CHUNK;
+            task->limit = seg->end;
+            task->aligned = pos == start;
+        }
+    }
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int num_threads = cores < 1 ? 1 : cores > MAX_REPLAY_THREADS ? MAX_REPLAY_THREADS : cores;
+    if (num_threads > replay.num_tasks) num_threads = replay.num_tasks ? replay.num_tasks : 1;
+    ReplayWorker workers[MAX_REPLAY_THREADS];
+    pthread_t threads[MAX_REPLAY_THREADS];
+    for (int t = 0; t < num_threads; t++) {
+        workers[t].seats = calloc(num_flights ? num_flights : 1, sizeof(int));
+        workers[t].replayed = 0;
+        if (!workers[t].seats) {
+            perror("Erreur d'allocation du rejeu");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int t = 1; t < num_threads; t++) {
+        if (pthread_create(&threads[t], NULL, replay_worker, &workers[t]) != 0) {
+            perror("Erreur lors de la création d'un thread de rejeu");
+            exit(EXIT_FAILURE);
+        }
+    }
+    replay_worker(&workers[0]);
+    int replayed = 0;
+    for (int t = 0; t < num_threads; t++) {
+        if (t > 0) pthread_join(threads[t], NULL);
+        for (int i = 0; i < num_flights; i++) flights[i].available_seats += workers[t].seats[i];
+        replayed += workers[t].replayed;
+        free(workers[t].seats);
+    }
+
+    for (int i = first; i < segments.count; i++) {
+        if (maps[i]) munmap(maps[i], segments.list[i].end - segments.list[i].start);
+    }
+    free(maps);
+    free(replay.tasks);
+    printf("Transactions rejouées: %d (%d tâche(s), %d thread(s))\n", replayed,
+           replay.num_tasks, num_threads);
+}
+
+HistoryEntry *history_entry(uint32_t n) {
+    return &history.chunks[n / HISTORY_CHUNK_SIZE][n % HISTORY_CHUNK_SIZE];
+}
+
+// Dernière entrée (+ 1) de la clé key, en la créant si create (thread du
+// journal uniquement). NULL si la clé est inconnue ou la table pleine.
+uint32_t *history_head(HistoryKeys *keys, int key, int create) {
+    IntMap *index = __atomic_load_n(&keys->index, __ATOMIC_ACQUIRE);
+    int slot = intmap_find(index, key);
+    if (slot == -1) {
+        if (!create || keys->count == HISTORY_KEY_CHUNK_SIZE * HISTORY_MAX_KEY_CHUNKS) return NULL;
+        slot = keys->count;
+        uint32_t **chunk = &keys->heads[slot / HISTORY_KEY_CHUNK_SIZE];
+        if (!*chunk) *chunk = calloc(HISTORY_KEY_CHUNK_SIZE, sizeof(uint32_t));
+        if (!*chunk) return NULL;
+        if ((index->count + 1) * 2 > index->capacity) {
+            index = intmap_grow(index); // L'ancienne table reste lisible
+            __atomic_store_n(&keys->index, index, __ATOMIC_RELEASE);
+        }
+        intmap_put(index, key, slot);
+        keys->count++;
+    }
+    return &keys->heads[slot / HISTORY_KEY_CHUNK_SIZE][slot % HISTORY_KEY_CHUNK_SIZE];
+}
+
+// Ajoute à l'index une entrée déjà remplie (lsn, time, ref, agence, length).
+// Renvoie 0 si l'index est plein.
+int history_add(HistoryEntry *entry) {
+    uint32_t n = history.count;
+    if (n == (uint32_t)HISTORY_CHUNK_SIZE * HISTORY_MAX_CHUNKS) return 0;
+    HistoryEntry **chunk = &history.chunks[n / HISTORY_CHUNK_SIZE];
+    if (!*chunk && !(*chunk = malloc(HISTORY_CHUNK_SIZE * sizeof(HistoryEntry)))) {
+        perror("Erreur d'allocation de l'index de l'historique");
+        exit(EXIT_FAILURE);
+    }
+    uint32_t *flight_head = history_head(&history.flights, entry->ref, 1);
+    uint32_t *agency_head = history_head(&history.agencies, entry->agency_id, 1);
+    entry->prev_flight = flight_head ? *flight_head : 0;
+    entry->prev_agency = agency_head ? *agency_head : 0;
+    *history_entry(n) = *entry;
+    // L'entrée est écrite avant d'être accessible par les têtes et count
+    if (flight_head) __atomic_store_n(flight_head, n + 1, __ATOMIC_RELEASE);
+    if (agency_head) __atomic_store_n(agency_head, n + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&history.count, n + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// Indexe une ligne de histo.txt commençant à lsn (length octets, '\n'
+// compris): une entrée par vol, toutes au même lsn pour un lot
+void history_index_line(uint64_t lsn, const char *line, size_t length) {
+    JournalRecord rec;
+    for (int i = 0; parse_journal_line(line, &rec) && i < rec.legs; i++) {
+        HistoryEntry entry = { .lsn = lsn, .length = length, .time = rec.time,
+                               .ref = rec.refs[i], .agency_id = rec.agency_id };
+        if (history.count > 0 && entry.time < history_entry(history.count - 1)->time) {
+            entry.time = history_entry(history.count - 1)->time; // Ancienne ligne sans heure
+        }
+        if (history_add(&entry) && history.index_fd >= 0) {
+            buffer_append(&history.pending, (const char *)history_entry(history.count - 1),
+                          sizeof(HistoryEntry));
+        }
+    }
+    __atomic_store_n(&history.end_lsn, lsn + length, __ATOMIC_RELEASE);
+}
+
+// Ajoute les entrées en attente à histo.idx. En cas d'erreur, le fichier
+// n'est plus tenu à jour: il sera complété au prochain démarrage.
+void history_write_index() {
+    const char *data = history.pending.data;
+    size_t len = history.pending.len;
+    while (history.index_fd >= 0 && len > 0) {
+        ssize_t n = write(history.index_fd, data, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            perror("Erreur d'écriture dans histo.idx");
+            close(history.index_fd);
+            history.index_fd = -1;
+            break;
+        }
+        data += n;
+        len -= n;
+    }
+    history.pending.len = 0;
+}
+
+// Indexe un lot de lignes que le thread du journal vient d'écrire à lsn
+void history_index_batch(uint64_t lsn, const char *data, size_t len) {
+    char line[JOURNAL_LINE_MAX];
+    while (len > 0) {
+        const char *end = memchr(data, '\n', len);
+        size_t length = end ? (size_t)(end - data) + 1 : len;
+        size_t copied = length < sizeof(line) ? length : sizeof(line) - 1;
+        memcpy(line, data, copied);
+        line[copied] = '\0';
+        history_index_line(lsn, line, length);
+        lsn += length;
+        data += length;
+        len -= length;
+    }
+    history_write_index();
+}
+
+// Réécrit histo.idx avec les seules entrées chargées (celles des segments
+// compactés en moins; leurs liens vers les précédentes ont été recalculés)
+void history_rewrite_index() {
+    char tmp[64];
+    FILE *fp = open_temp_file("histo.idx", tmp, sizeof(tmp));
+    for (uint32_t n = 0; fp && n < history.count; n += HISTORY_CHUNK_SIZE) {
+        uint32_t count = history.count - n < HISTORY_CHUNK_SIZE ? history.count - n : HISTORY_CHUNK_SIZE;
+        fwrite(history.chunks[n / HISTORY_CHUNK_SIZE], sizeof(HistoryEntry), count, fp);
+    }
+    if (!fp || commit_file(fp, tmp, "histo.idx") < 0) exit(EXIT_FAILURE);
+    close(history.index_fd);
+    history.index_fd = open("histo.idx", O_RDWR | O_APPEND, 0644);
+    if (history.index_fd < 0) {
+        perror("Erreur lors de l'ouverture de histo.idx");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Charge histo.idx et indexe les lignes du journal qu'il ne couvre pas
+// encore (index absent, ou serveur arrêté avant de l'avoir écrit)
+void history_open() {
+    history.flights.index = intmap_create(1024);
+    history.agencies.index = intmap_create(1024);
+    history.index_fd = open("histo.idx", O_RDWR | O_APPEND | O_CREAT, 0644);
+    struct stat index_st;
+    if (history.index_fd < 0 || fstat(history.index_fd, &index_st) < 0) {
+        perror("Erreur lors de l'ouverture de l'historique");
+        exit(EXIT_FAILURE);
+    }
+
+    // Entrées valides de histo.idx: celles qui décrivent bien des lignes
+    // du journal (un journal remplacé ou tronqué invalide la suite). Celles
+    // des segments compactés sont retirées.
+    uint64_t stored = index_st.st_size / sizeof(HistoryEntry), compacted = 0;
+    uint64_t journal_size = journal_end();
+    history.end_lsn = aggregates.lsn;
+    char line[JOURNAL_LINE_MAX];
+    for (uint64_t i = 0; i < stored; i++) {
+        HistoryEntry entry;
+        if (pread(history.index_fd, &entry, sizeof(entry), i * sizeof(entry)) != sizeof(entry) ||
+            entry.length == 0 || entry.lsn + entry.length > journal_size) {
+            break;
+        }
+        if (entry.lsn < aggregates.lsn) {
+            compacted++;
+            continue;
+        }
+        if (entry.lsn < history.end_lsn && // Seuls les vols d'un même lot partagent un lsn
+            entry.lsn != history_entry(history.count - 1)->lsn) {
+            break;
+        }
+        if (i + 1 == stored || i % HISTORY_CHUNK_SIZE == 0) { // Contrôle par échantillon
+            size_t size = entry.length < sizeof(line) ? entry.length : sizeof(line) - 1;
+            JournalRecord rec;
+            if (journal_pread(line, size, entry.lsn) != (ssize_t)size) break;
+            line[size] = '\0';
+            if (!parse_journal_line(line, &rec)) break;
+            int leg = 0;
+            while (leg < rec.legs && rec.refs[leg] != entry.ref) leg++;
+            if (leg == rec.legs || rec.agency_id != entry.agency_id) break;
+        }
+        if (!history_add(&entry)) break;
+        history.end_lsn = entry.lsn + entry.length;
+    }
+    if (compacted > 0) {
+        history_rewrite_index();
+    } else if (history.count < stored &&
+               ftruncate(history.index_fd, history.count * sizeof(HistoryEntry)) < 0) {
+        perror("Erreur lors de la troncature de histo.idx");
+        exit(EXIT_FAILURE);
+    }
+
+    uint32_t loaded = history.count;
+    static JournalReader reader;
+    reader.lsn = history.end_lsn;
+    size_t length;
+    while ((length = journal_next_line(&reader, journal_size, line, sizeof(line))) > 0) {
+        history_index_line(reader.lsn - length, line, length);
+    }
+    history_write_index();
+    if (history.count > 0) journal.last_time = history_entry(history.count - 1)->time;
+    printf("Historique indexé: %u transactions (%u nouvelles)\n", history.count,
+           history.count - loaded);
+}
+
+// Parcourt un instantané de l'historique, de la transaction la plus récente
+// à la plus ancienne: toutes (HISTORY_ALL), celles d'une agence ou d'un vol
+// (key), ou celles entre les horodatages key et to. Seules les entrées
+// d'indice < cursor sont considérées (0: toutes). Ajoute au plus limit
+// lignes à out et renvoie le curseur de la page suivante (0: fin).
+uint32_t history_query(int kind, long long key, long long to, uint32_t cursor, int limit,
+                       Buffer *out) {
+    uint32_t count = __atomic_load_n(&history.count, __ATOMIC_ACQUIRE);
+    if (cursor == 0 || cursor > count) cursor = count;
+    uint32_t n = cursor; // Prochaine entrée candidate + 1
+    if (kind == HISTORY_AGENCY || kind == HISTORY_FLIGHT) {
+        HistoryKeys *keys = kind == HISTORY_AGENCY ? &history.agencies : &history.flights;
+        uint32_t *head = key == (int)key ? history_head(keys, key, 0) : NULL;
+        n = head ? __atomic_load_n(head, __ATOMIC_ACQUIRE) : 0;
+    } else if (kind == HISTORY_TIME) {
+        uint32_t low = 0, high = cursor; // Dernière entrée d'horodatage <= to
+        while (low < high) {
+            uint32_t mid = low + (high - low) / 2;
+            if (history_entry(mid)->time <= to) low = mid + 1;
+            else high = mid;
+        }
+        n = low;
+    }
+
+    int returned = 0;
+    uint64_t compacted = __atomic_load_n(&aggregates.lsn, __ATOMIC_ACQUIRE);
+    uint64_t last_lsn = UINT64_MAX; // Les vols d'un lot partagent leur ligne
+    while (n > 0) {
+        HistoryEntry *entry = history_entry(n - 1);
+        uint32_t prev = kind == HISTORY_AGENCY ? entry->prev_agency
+                      : kind == HISTORY_FLIGHT ? entry->prev_flight : n - 1;
+        if (n > cursor) { // Plus récente que l'instantané ou que la page précédente
+            n = prev;
+            continue;
+        }
+        if (kind == HISTORY_TIME && entry->time < key) return 0;
+        if (entry->lsn < compacted) return 0; // Archivée: voir histo.agg
+        if (entry->lsn == last_lsn) {
+            n = prev;
+            continue;
+        }
+        if (returned == limit) break;
+        buffer_reserve(out, entry->length);
+        if (journal_pread(out->data + out->len, entry->length,
+                          entry->lsn) == (ssize_t)entry->length) {
+            out->len += entry->length;
+        }
+        returned++;
+        last_lsn = entry->lsn;
+        n = prev;
+    }
+    return n;
+}
+
+// Anneau io_uring (option -u), piloté par appels système directs: le
+// serveur n'utilise que quelques opérations et ne dépend pas de liburing.
+// Chaque anneau appartient à un seul thread: les SQE préparées s'accumulent
+// et partent toutes au prochain ring_enter(), qui attend aussi les
+// complétions (un appel système pour tout un lot).
+typedef struct {
+    int fd;
+    unsigned entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    unsigned sq_local_tail;      // SQE préparées, pas encore publiées
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+} Ring;
+
+int ring_init(Ring *ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) return -1;
+    // Sans NODROP, des complétions pourraient être perdues quand la file
+    // déborde (une réception en cours par connexion)
+    if (!(params.features & IORING_FEAT_NODROP)) {
+        close(ring->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cq_size > sq_size) sq_size = cq_size;
+    }
+    char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring->fd, IORING_OFF_SQ_RING);
+    char *cq = sq;
+    if (sq != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  ring->fd, IORING_OFF_CQ_RING);
+    }
+    ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+    ring->entries = params.sq_entries;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    ring->sq_local_tail = *ring->sq_tail;
+    return 0;
+}
+
+// Publie les SQE préparées, les soumet et attend wait_nr complétions.
+// -1 (errno) si l'appel échoue; EBUSY: vider les complétions d'abord.
+int ring_enter(Ring *ring, unsigned wait_nr) {
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    return syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_nr,
+                   wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+// Prochaine SQE libre, remise à zéro (la file pleine est d'abord soumise)
+struct io_uring_sqe *ring_sqe(Ring *ring) {
+    while (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >=
+           ring->entries) {
+        if (ring_enter(ring, 0) < 0 && errno != EINTR && errno != EBUSY) {
+            perror("Erreur lors de la soumission io_uring");
+            exit(EXIT_FAILURE);
+        }
+    }
+    unsigned index = ring->sq_local_tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ring->sq_local_tail++;
+    return sqe;
+}
+
+// Complétion la plus ancienne, NULL si aucune. ring_seen() la libère.
+struct io_uring_cqe *ring_peek(Ring *ring) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void ring_seen(Ring *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+void ring_close(Ring *ring) {
+    close(ring->fd); // Les projections disparaissent avec le processus
+}
+
+// Le noyau sait-il faire tout ce dont le serveur a besoin? (io_uring peut
+// être absent, désactivé par kernel.io_uring_disabled ou filtré par seccomp)
+int uring_supported() {
+    Ring ring;
+    if (ring_init(&ring, 8) < 0) return 0;
+    static const int needed[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND,
+                                  IORING_OP_WRITE, IORING_OP_FSYNC, IORING_OP_READ };
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    int ok = probe && syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PROBE,
+                              probe, 256) == 0;
+    for (size_t i = 0; ok && i < sizeof(needed) / sizeof(needed[0]); i++) {
+        ok = needed[i] <= probe->last_op &&
+             (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    ring_close(&ring);
+    return ok;
+}
+
+// Écrit un lot du journal à l'offset lsn et, si sync, enchaîne son
+// fdatasync (IOSQE_IO_LINK) dans la même soumission. Renvoie le nombre
+// d'octets écrits (l'appelant complète une écriture partielle) et indique
+// dans *synced si le fdatasync a eu lieu.
+size_t uring_journal_write(Ring *ring, const char *data, size_t len, uint64_t lsn,
+                           int sync, int *synced) {
+    struct io_uring_sqe *sqe = ring_sqe(ring);
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = journal.fd;
+    sqe->addr = (uintptr_t)data;
+    sqe->len = len;
+    sqe->off = lsn - journal.base;
+    sqe->user_data = 0;
+    if (sync) {
+        sqe->flags = IOSQE_IO_LINK;
+        sqe = ring_sqe(ring);
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fd = journal.fd;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        sqe->user_data = 1;
+    }
+    unsigned expected = sync ? 2 : 1;
+    size_t written = 0;
+    *synced = 0;
+    for (unsigned done = 0; done < expected; ) {
+        if (ring_enter(ring, expected - done) < 0 && errno != EINTR) {
+            perror("Erreur io_uring sur histo.txt");
+            exit(EXIT_FAILURE);
+        }
+        struct io_uring_cqe *cqe;
+        while ((cqe = ring_peek(ring))) {
+            if (cqe->user_data == 0 && cqe->res > 0) written = cqe->res;
+            if (cqe->user_data == 1 && cqe->res == 0) *synced = 1;
+            ring_seen(ring);
+            done++;
+        }
+    }
+    return written;
+}
+
+// Écrit tout le tampon, en reprenant après les écritures partielles
+void write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            perror("Erreur d'écriture dans histo.txt");
+            exit(EXIT_FAILURE); // Impossible d'acquitter sans journal
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+void add_ms(struct timespec *ts, int ms) {
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (long)(ms % 1000) * 1000000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+int time_reached(const struct timespec *deadline) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec > deadline->tv_sec ||
+           (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec);
+}
+
+// Scelle le segment actif, qui se termine à end: histo.txt est synchronisé,
+// renommé histo-<début>.txt, et un nouveau histo.txt commence à end
+void journal_rotate(uint64_t end) {
+    char path[64];
+    segment_path(path, sizeof(path), journal.base);
+    if (fdatasync(journal.fd) < 0 || rename("histo.txt", path) < 0) {
+        perror("Erreur lors de la rotation de histo.txt");
+        exit(EXIT_FAILURE);
+    }
+    int fd = open("histo.txt", O_WRONLY | O_APPEND | O_CREAT | O_TRUNC, 0644);
+    int read_fd = open("histo.txt", O_RDONLY);
+    if (fd < 0 || read_fd < 0) {
+        perror("Erreur lors de l'ouverture de histo.txt");
+        exit(EXIT_FAILURE);
+    }
+    sync_directory(".");
+    segment_add(end, end, read_fd);
+    close(journal.fd);
+    journal.fd = fd;
+    journal.base = end;
+}
+
+// Réveille les workers dont une connexion mise de côté est devenue durable
+void journal_wake_parked(uint64_t acked) {
+    for (Parked *p = __atomic_load_n(&parked_workers, __ATOMIC_ACQUIRE); p; p = p->next) {
+        uint64_t lsn = __atomic_load_n(&p->wait_lsn, __ATOMIC_SEQ_CST);
+        if (lsn > 0 && lsn <= acked) {
+            uint64_t one = 1;
+            if (write(p->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+                perror("Erreur lors du réveil d'un worker");
+            }
+        }
+    }
+}
+
+// Thread d'écriture du journal: validation groupée des lignes en attente
+void* journal_writer(void* arg) {
+    Buffer batch = {0};
+    Ring ring, *uring = NULL;
+    if (use_uring) {
+        if (ring_init(&ring, 8) == 0) {
+            uring = &ring;
+        } else {
+            perror("io_uring indisponible pour histo.txt, écritures classiques");
+        }
+    }
+    uint64_t synced_lsn = journal.acked_lsn;
+    struct timespec next_sync;
+    clock_gettime(CLOCK_REALTIME, &next_sync);
+
+    pthread_mutex_lock(&journal.lock);
+    while (1) {
+        while (journal.pending.len == 0) {
+            if (sync_interval_ms > 0 && synced_lsn < journal.acked_lsn) {
+                // Des lignes écrites attendent leur fdatasync périodique
+                if (pthread_cond_timedwait(&journal.appended, &journal.lock,
+                                           &next_sync) == ETIMEDOUT) break;
+            } else {
+                pthread_cond_wait(&journal.appended, &journal.lock);
+            }
+        }
+        // Échange des tampons: les requêtes continuent d'ajouter pendant l'écriture
+        Buffer tmp = journal.pending;
+        journal.pending = batch;
+        batch = tmp;
+        int batch_count = journal.pending_count;
+        journal.pending_count = 0;
+        uint64_t end = journal.appended_lsn;
+        pthread_mutex_unlock(&journal.lock);
+
+        uint64_t start = now_ns();
+        int sync = synced_lsn < end && (sync_interval_ms == 0 || time_reached(&next_sync));
+        int synced = 0;
+        size_t written = 0;
+        if (uring) {
+            // Écriture et fdatasync liés: un seul appel système par lot
+            written = uring_journal_write(uring, batch.data, batch.len,
+                                          end - batch.len, sync, &synced);
+        }
+        write_all(journal.fd, batch.data + written, batch.len - written);
+        __atomic_store_n(&segments.list[segments.count - 1].end, end, __ATOMIC_RELEASE);
+        stats_io(synced ? IO_JOURNAL_SYNC : IO_JOURNAL_WRITE, start);
+        thread_stats()->journal_bytes += batch.len;
+        if (sync) {
+            if (!synced) {
+                start = now_ns();
+                if (fdatasync(journal.fd) < 0) {
+                    perror("Erreur lors de la synchronisation de histo.txt");
+                    exit(EXIT_FAILURE);
+                }
+                stats_io(IO_JOURNAL_SYNC, start);
+            }
+            synced_lsn = end;
+            clock_gettime(CLOCK_REALTIME, &next_sync);
+            add_ms(&next_sync, sync_interval_ms);
+        }
+        history_index_batch(end - batch.len, batch.data, batch.len);
+        batch.len = 0;
+        if (segment_size > 0 && end - journal.base >= (uint64_t)segment_size &&
+            segments.count < MAX_SEGMENTS) {
+            journal_rotate(end); // Synchronise tout ce qui précède end
+            synced_lsn = end;
+        }
+
+        pthread_mutex_lock(&journal.lock);
+        // Publiée avant la lecture des wait_lsn (voir parked_release)
+        __atomic_store_n(&journal.acked_lsn, sync_interval_ms == 0 ? synced_lsn : end,
+                         __ATOMIC_SEQ_CST);
+        __atomic_store_n(&journal.queued, journal.queued - batch_count, __ATOMIC_RELAXED);
+        pthread_cond_broadcast(&journal.durable);
+        journal_wake_parked(journal.acked_lsn);
+    }
+    return NULL;
+}
+
+// Ouvre histo.txt (segment actif) en ajout et démarre le thread
+// d'écriture du journal
+void journal_open() {
+    journal.fd = open("histo.txt", O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (journal.fd < 0) {
+        perror("Erreur lors de l'ouverture de histo.txt");
+        exit(EXIT_FAILURE);
+    }
+    journal.base = segments.list[segments.count - 1].start;
+    journal.appended_lsn = journal.acked_lsn = journal_end();
+
+    pthread_t writer;
+    if (pthread_create(&writer, NULL, journal_writer, NULL) != 0) {
+        perror("Erreur lors de la création du thread journal");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(writer);
+}
+
+// Ajoute une ligne au journal pour un ou plusieurs vols (un lot) et renvoie
+// la position à attendre avant d'acquitter la requête (voir journal_wait)
+uint64_t journal_append_legs(const int *refs, const int *values, int legs, int agency_id,
+                             const char *transaction, const char *result) {
+    // Mise en forme hors du verrou; seul l'horodatage est ajouté dessous
+    char line[JOURNAL_LINE_MAX];
+    int len = 0;
+    for (int i = 0; i < legs; i++) {
+        len += snprintf(line + len, sizeof(line) - len, i ? ",%d" : "%d", refs[i]);
+    }
+    len += snprintf(line + len, sizeof(line) - len, " %d %s ", agency_id, transaction);
+    for (int i = 0; i < legs; i++) {
+        len += snprintf(line + len, sizeof(line) - len, i ? ",%d" : "%d", values[i]);
+    }
+    snprintf(line + len, sizeof(line) - len, " %s", result);
+
+    long long now = time(NULL);
+    uint64_t locked = stats_lock(&journal.lock, LOCK_JOURNAL);
+    if (now < journal.last_time) now = journal.last_time; // Horloge reculée
+    journal.last_time = now;
+    size_t before = journal.pending.len;
+    buffer_printf(&journal.pending, "%s %lld\n", line, now);
+    journal.appended_lsn += journal.pending.len - before;
+    journal.pending_count++;
+    __atomic_store_n(&journal.queued, journal.queued + 1, __ATOMIC_RELAXED);
+    uint64_t lsn = journal.appended_lsn;
+    pthread_cond_signal(&journal.appended);
+    stats_unlock(&journal.lock, LOCK_JOURNAL, locked);
+    return lsn;
+}
+
+uint64_t journal_append(int ref, int agency_id, const char *transaction, int value, const char *result) {
+    return journal_append_legs(&ref, &value, 1, agency_id, transaction, result);
+}
+
+// Bloque jusqu'à ce que le journal soit durable jusqu'à lsn
+void journal_wait(uint64_t lsn) {
+    if (lsn == 0) return;
+    uint64_t start = now_ns();
+    pthread_mutex_lock(&journal.lock);
+    while (journal.acked_lsn < lsn) {
+        pthread_cond_wait(&journal.durable, &journal.lock);
+    }
+    pthread_mutex_unlock(&journal.lock);
+    hist_add(&thread_stats()->durable_wait, now_ns() - start);
+}
+
+// Prépare la liste des connexions mises de côté d'un worker et l'inscrit
+// auprès de journal_writer (flags: EFD_NONBLOCK pour epoll, 0 pour io_uring
+// dont la lecture doit attendre le réveil)
+void parked_init(Parked *p, int flags) {
+    memset(p, 0, sizeof(*p));
+    p->event_fd = eventfd(0, flags | EFD_CLOEXEC);
+    if (p->event_fd < 0) {
+        perror("Erreur lors de la création de l'eventfd du worker");
+        exit(EXIT_FAILURE);
+    }
+    p->next = __atomic_load_n(&parked_workers, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&parked_workers, &p->next, p, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// Met de côté une connexion dont la réponse attend la position conn->lsn
+void parked_add(Parked *p, Connection *conn) {
+    if (p->count == p->cap) {
+        int cap = p->cap ? p->cap * 2 : 64;
+        Connection **list = realloc(p->list, cap * sizeof(*list));
+        if (!list) {
+            perror("Erreur d'allocation des connexions en attente");
+            exit(EXIT_FAILURE);
+        }
+        p->list = list;
+        p->cap = cap;
+    }
+    conn->parked_ns = now_ns();
+    p->list[p->count++] = conn;
+}
+
+// Retire (au plus max) connexions devenues durables et les place dans
+// ready; publie la plus petite position encore attendue. Le worker écrit
+// wait_lsn puis relit acked_lsn, journal_writer fait l'inverse: l'un des
+// deux voit toujours l'autre, aucun réveil n'est perdu.
+int parked_release(Parked *p, Connection **ready, int max) {
+    int n = 0;
+    while (p->count > 0) {
+        uint64_t acked = __atomic_load_n(&journal.acked_lsn, __ATOMIC_SEQ_CST);
+        uint64_t now = now_ns();
+        uint64_t min = 0;
+        int kept = 0;
+        for (int i = 0; i < p->count; i++) {
+            Connection *conn = p->list[i];
+            if (conn->lsn <= acked && n < max) {
+                hist_add(&thread_stats()->durable_wait, now - conn->parked_ns);
+                ready[n++] = conn;
+            } else {
+                p->list[kept++] = conn;
+                if (min == 0 || conn->lsn < min) min = conn->lsn;
+            }
+        }
+        p->count = kept;
+        __atomic_store_n(&p->wait_lsn, min, __ATOMIC_SEQ_CST);
+        if (min == 0 || n == max ||
+            __atomic_load_n(&journal.acked_lsn, __ATOMIC_SEQ_CST) < min) {
+            break;
+        }
+    }
+    return n;
+}
+
+// Écrit et synchronise tout ce qui a été journalisé (arrêt du serveur)
+void journal_flush() {
+    pthread_mutex_lock(&journal.lock);
+    uint64_t lsn = journal.appended_lsn;
+    pthread_mutex_unlock(&journal.lock);
+    journal_wait(lsn);
+    fdatasync(journal.fd);
+}
+
+// Réplique en lecture (-R hôte:port, le port de réplication -J du
+// primaire). Le serveur recopie le journal du primaire (OP_JOURNAL) à la
+// fin de son propre histo.txt et l'applique à ses vols et à ses agences; il
+// sert CONSULT, INVOICE, SEARCH, HISTORY... et refuse les modifications
+// (READ_ONLY). Son histo.txt reste ainsi un préfixe exact de celui du
+// primaire: au redémarrage, il rejoue le sien et reprend la copie là où
+// elle s'était arrêtée.
+int replica_sock = -1;
+
+// Lit exactement len octets (socket bloquant); -1 si la connexion est perdue
+int recv_exact(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int replica_lost() {
+    perror("Connexion au primaire perdue");
+    close(replica_sock);
+    replica_sock = -1;
+    return -1;
+}
+
+// Demande au primaire la suite de son journal à partir de lsn. Renvoie le
+// nombre d'octets reçus dans reply (lignes complètes, 0: rien de nouveau),
+// ou -1 si la connexion est perdue. *end reçoit la fin durable du primaire.
+ssize_t replica_fetch(uint64_t lsn, Buffer *reply, uint64_t *end) {
+    while (replica_sock < 0) {
+        replica_sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (replica_sock < 0 ||
+            connect(replica_sock, (struct sockaddr*)&primary_addr, sizeof(primary_addr)) < 0) {
+            perror("Primaire injoignable, nouvel essai dans 1 s");
+            if (replica_sock >= 0) close(replica_sock);
+            replica_sock = -1;
+            sleep(1);
+            continue;
+        }
+        // Un primaire muet est traité comme une connexion perdue
+        struct timeval timeout = { .tv_sec = REPLICA_TIMEOUT, .tv_usec = 0 };
+        setsockopt(replica_sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        printf("Réplique connectée au primaire %s (position %llu)\n", primary_address,
+               (unsigned long long)lsn);
+    }
+
+    unsigned char request[FRAME_HEADER_SIZE + 12];
+    encode_frame_header(request, OP_JOURNAL, 0, 0, 12);
+    put_u64(request + FRAME_HEADER_SIZE, lsn);
+    put_u32(request + FRAME_HEADER_SIZE + 8, REPLICA_CHUNK);
+    unsigned char header[FRAME_HEADER_SIZE];
+    int opcode, status;
+    uint32_t request_id, length;
+    if (send(replica_sock, request, sizeof(request), MSG_NOSIGNAL) != sizeof(request) ||
+        recv_exact(replica_sock, header, sizeof(header)) < 0) {
+        return replica_lost();
+    }
+    decode_frame_header(header, &opcode, &status, &request_id, &length);
+    if (header[0] != FRAME_MAGIC || length > MAX_FRAME_PAYLOAD) return replica_lost();
+    reply->len = 0;
+    buffer_reserve(reply, length);
+    if (recv_exact(replica_sock, reply->data, length) < 0) return replica_lost();
+    if (status != ST_SUCCESS || length < 8) {
+        // Le primaire n'a pas ce journal (ou l'a compacté): la réplique ne
+        // peut pas le suivre
+        fprintf(stderr, "Le primaire refuse la position %llu du journal: la copie locale"
+                " ne vient pas de lui, ou cette partie est compactée (repartir de"
+                " son vols.txt et de son histo.agg)\n", (unsigned long long)lsn);
+        exit(EXIT_FAILURE);
+    }
+    *end = get_u64((unsigned char *)reply->data);
+    reply->len = length - 8;
+    memmove(reply->data, reply->data + 8, reply->len);
+    if (reply->len > 0 && reply->data[reply->len - 1] != '\n') return replica_lost();
+    return reply->len;
+}
+
+// Applique les lignes reçues (commençant à la position pos) aux vols et aux
+// agences. Les places d'une ligne antérieure à seats_from sont déjà dans
+// vols.txt: seuls les totaux en tiennent compte, comme pour replay_history.
+void replica_apply(const char *data, size_t len, uint64_t pos, uint64_t seats_from) {
+    char line[JOURNAL_LINE_MAX];
+    for (size_t start = 0; start < len; ) {
+        const char *newline = memchr(data + start, '\n', len - start);
+        size_t size = newline - (data + start) + 1;
+        if (size < sizeof(line)) {
+            memcpy(line, data + start, size);
+            line[size] = '\0';
+            int agency_id, flight_idx[MAX_BATCH_LEGS], seats[MAX_BATCH_LEGS];
+            long long cents[MAX_BATCH_LEGS];
+            int legs = parse_history_line(line, &agency_id, flight_idx, seats, cents);
+            Agency *agency = legs > 0 ? get_agency(agency_id) : NULL;
+            for (int i = 0; agency && i < legs; i++) {
+                if (pos + start >= seats_from) add_seats(&flights[flight_idx[i]], seats[i]);
+                add_payment(agency, cents[i]);
+            }
+        }
+        start += size;
+    }
+}
+
+// Au démarrage, avant l'ouverture du journal: si vols.txt (copié du
+// primaire) reflète une position plus avancée que le histo.txt local, la
+// partie manquante est d'abord recopiée, pour les totaux des agences et
+// pour que le fil de persistance reparte d'un état cohérent.
+void replica_catch_up(uint64_t seats_from) {
+    int fd = open("histo.txt", O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (fd < 0) {
+        perror("Erreur lors de l'ouverture de histo.txt");
+        exit(EXIT_FAILURE);
+    }
+    Buffer reply = {0};
+    uint64_t first = journal_end(), lsn = first, end;
+    while (lsn < vols_lsn) {
+        ssize_t n = replica_fetch(lsn, &reply, &end);
+        if (n < 0) continue;
+        if (n == 0) {
+            fprintf(stderr, "Le journal du primaire s'arrête avant la position de vols.txt\n");
+            exit(EXIT_FAILURE);
+        }
+        write_all(fd, reply.data, n);
+        replica_apply(reply.data, n, lsn, seats_from);
+        lsn += n;
+        __atomic_store_n(&segments.list[segments.count - 1].end, lsn, __ATOMIC_RELEASE);
+    }
+    if (lsn > first) {
+        fdatasync(fd);
+        printf("Réplique: %llu octets du journal du primaire rattrapés\n",
+               (unsigned long long)(lsn - first));
+    }
+    close(fd);
+    buffer_free(&reply);
+}
+
+// Fil de la réplique: recopie le journal du primaire au fil de l'eau. Les
+// octets passent par le journal local (même écriture, synchronisation et
+// indexation de l'historique que les lignes d'un primaire), puis sont
+// appliqués en mémoire.
+void* replica_thread(void* arg) {
+    Buffer reply = {0};
+    uint64_t lsn = journal.appended_lsn, end;
+    while (1) {
+        ssize_t n = replica_fetch(lsn, &reply, &end);
+        if (n <= 0) {
+            if (n == 0) usleep(REPLICA_POLL_MS * 1000);
+            continue;
+        }
+        int lines = 0;
+        for (ssize_t i = 0; i < n; i++) lines += reply.data[i] == '\n';
+        pthread_mutex_lock(&journal.lock);
+        buffer_append(&journal.pending, reply.data, n);
+        journal.appended_lsn += n;
+        journal.pending_count += lines;
+        __atomic_store_n(&journal.queued, journal.queued + lines, __ATOMIC_RELAXED);
+        pthread_cond_signal(&journal.appended);
+        pthread_mutex_unlock(&journal.lock);
+
+        replica_apply(reply.data, n, lsn, 0);
+        lsn += n;
+        __atomic_store_n(&replica_lsn, lsn, __ATOMIC_RELAXED);
+        __atomic_store_n(&primary_lsn, end, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+// Résout l'adresse hôte:port de l'option -R
+void resolve_primary() {
+    char host[256];
+    const char *colon = strrchr(primary_address, ':');
+    snprintf(host, sizeof(host), "%.*s", (int)(colon - primary_address), primary_address);
+    struct addrinfo hints, *result;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    int error = getaddrinfo(host, colon + 1, &hints, &result);
+    if (error != 0) {
+        fprintf(stderr, "Primaire %s introuvable: %s\n", primary_address, gai_strerror(error));
+        exit(EXIT_FAILURE);
+    }
+    memcpy(&primary_addr, result->ai_addr, sizeof(primary_addr));
+    freeaddrinfo(result);
+}
+
+void start_replica() {
+    replica_lsn = primary_lsn = journal.appended_lsn;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, replica_thread, NULL) != 0) {
+        perror("Erreur lors de la création du thread de réplication");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+}
+
+// Ajoute un montant au total d'une agence dans la copie du point de reprise
+void checkpoint_add_payment(int agency_id, long long cents) {
+    int slot = intmap_find(checkpoint.agency_index, agency_id);
+    if (slot == -1) {
+        if (checkpoint.num_agencies == checkpoint.agencies_capacity) {
+            int capacity = checkpoint.agencies_capacity ? checkpoint.agencies_capacity * 2 : 1024;
+            int *ids = realloc(checkpoint.agency_ids, capacity * sizeof(int));
+            if (ids) checkpoint.agency_ids = ids;
+            long long *totals = realloc(checkpoint.agency_totals, capacity * sizeof(long long));
+            if (totals) checkpoint.agency_totals = totals;
+            if (!ids || !totals) {
+                perror("Erreur d'allocation du point de reprise");
+                exit(EXIT_FAILURE);
+            }
+            checkpoint.agencies_capacity = capacity;
+        }
+        if ((checkpoint.agency_index->count + 1) * 2 > checkpoint.agency_index->capacity) {
+            IntMap *old = checkpoint.agency_index;
+            checkpoint.agency_index = intmap_grow(old);
+            intmap_free(old);
+        }
+        slot = checkpoint.num_agencies++;
+        checkpoint.agency_ids[slot] = agency_id;
+        checkpoint.agency_totals[slot] = 0;
+        intmap_put(checkpoint.agency_index, agency_id, slot);
+    }
+    checkpoint.agency_totals[slot] += cents;
+}
+
+// Applique à la copie du point de reprise les lignes du journal jusqu'à end
+void checkpoint_apply_journal(uint64_t end) {
+    char line[JOURNAL_LINE_MAX];
+    checkpoint.journal.lsn = checkpoint.lsn;
+    while (journal_next_line(&checkpoint.journal, end, line, sizeof(line)) > 0) {
+        int agency_id, flight_idx[MAX_BATCH_LEGS], seats[MAX_BATCH_LEGS];
+        long long cents[MAX_BATCH_LEGS];
+        int legs = parse_history_line(line, &agency_id, flight_idx, seats, cents);
+        for (int i = 0; i < legs; i++) {
+            checkpoint.seats[flight_idx[i]] += seats[i];
+            checkpoint_add_payment(agency_id, cents[i]);
+            if (seats[i] != 0) checkpoint.seats_dirty = 1;
+            if (cents[i] != 0) checkpoint.totals_dirty = 1;
+        }
+        checkpoint.lsn = checkpoint.journal.lsn;
+    }
+}
+
+// Écrit checkpoint.txt
+void write_checkpoint() {
+    char tmp[64];
+    FILE *fp = open_temp_file("checkpoint.txt", tmp, sizeof(tmp));
+    if (!fp) return;
+    fprintf(fp, "CHECKPOINT %llu\n", (unsigned long long)checkpoint.lsn);
+    for (int i = 0; i < num_flights; i++) {
+        fprintf(fp, "VOL %d %d\n", flights[i].ref, checkpoint.seats[i]);
+    }
+    for (int i = 0; i < checkpoint.num_agencies; i++) {
+        fprintf(fp, "AGENCE %d %lld\n", checkpoint.agency_ids[i], checkpoint.agency_totals[i]);
+    }
+    if (commit_file(fp, tmp, "checkpoint.txt") < 0) return;
+    checkpoint.checkpoint_lsn = checkpoint.lsn;
+    checkpoint.checkpoint_time = time(NULL);
+}
+
+// Met à jour vols.txt; l'en-tête indique la position du journal reflétée
+// par les places, pour ne pas la rejouer une seconde fois au démarrage
+void update_vols() {
+    char tmp[64];
+    FILE *fp = open_temp_file("vols.txt", tmp, sizeof(tmp));
+    if (!fp) return;
+    fprintf(fp, "# histo.txt %llu\n", (unsigned long long)checkpoint.lsn);
+    for (int i = 0; i < num_flights; i++) {
+        fprintf(fp, "%d %s %d %d\n", flights[i].ref, flights[i].destination,
+                checkpoint.seats[i], flights[i].price);
+    }
+    if (commit_file(fp, tmp, "vols.txt") == 0) checkpoint.seats_dirty = 0;
+}
+
+// Met à jour vols.bin sur place: seules les pages des vols modifiés sont
+// écrites. Les places vont dans le jeu inactif, puis l'en-tête bascule sur
+// lui une fois les enregistrements synchronisés (voir volsbin.h).
+void update_vols_bin() {
+    VolsBinRecord *records = (VolsBinRecord *)(vols_bin + 1);
+    int next = !vols_bin->active;
+    for (int i = 0; i < num_flights; i++) {
+        if (records[i].seats[next] != checkpoint.seats[i]) {
+            records[i].seats[next] = checkpoint.seats[i];
+        }
+    }
+    if (msync(vols_bin, vols_bin_size, MS_SYNC) < 0) {
+        perror("Erreur lors de la synchronisation de vols.bin");
+        return;
+    }
+    vols_bin->lsn[next] = checkpoint.lsn;
+    vols_bin->active = next;
+    if (msync(vols_bin, sizeof(VolsBinHeader), MS_SYNC) < 0) {
+        perror("Erreur lors de la synchronisation de vols.bin");
+        return;
+    }
+    checkpoint.seats_dirty = 0;
+}
+
+int compare_agency_slots(const void *a, const void *b) {
+    int x = checkpoint.agency_ids[*(const int *)a];
+    int y = checkpoint.agency_ids[*(const int *)b];
+    return (x > y) - (x < y);
+}
+
+// Met à jour facture.txt avec les paiements totaux, triés par agence
+void update_facture() {
+    int *order = malloc((checkpoint.num_agencies + 1) * sizeof(int));
+    if (!order) return;
+    for (int i = 0; i < checkpoint.num_agencies; i++) order[i] = i;
+    qsort(order, checkpoint.num_agencies, sizeof(int), compare_agency_slots);
+
+    char tmp[64];
+    FILE *fp = open_temp_file("facture.txt", tmp, sizeof(tmp));
+    if (fp) {
+        for (int i = 0; i < checkpoint.num_agencies; i++) {
+            long long total = checkpoint.agency_totals[order[i]];
+            if (total != 0) {
+                fprintf(fp, "%d %.2f\n", checkpoint.agency_ids[order[i]], total / 100.0);
+            }
+        }
+        if (commit_file(fp, tmp, "facture.txt") == 0) checkpoint.totals_dirty = 0;
+    }
+    free(order);
+}
+
+// Rattrape le journal puis écrit les fichiers dont le contenu a changé.
+// force: écrit aussi le point de reprise sans attendre son intervalle.
+void persist(int force) {
+    uint64_t locked = stats_lock(&persist_mutex, LOCK_PERSIST);
+    pthread_mutex_lock(&journal.lock);
+    uint64_t end = journal.acked_lsn;
+    pthread_mutex_unlock(&journal.lock);
+
+    checkpoint_apply_journal(end);
+    int checkpoint_due = checkpoint_interval > 0 && checkpoint.lsn != checkpoint.checkpoint_lsn &&
+        (force || time(NULL) - checkpoint.checkpoint_time >= checkpoint_interval);
+    if (checkpoint.seats_dirty || checkpoint.totals_dirty || checkpoint_due) {
+        // Ce que ces fichiers reflètent doit être durable dans le journal
+        journal_sync();
+    }
+    uint64_t start = now_ns();
+    if (checkpoint_due) {
+        write_checkpoint();
+        stats_io(IO_CHECKPOINT, start);
+    }
+    if (checkpoint.seats_dirty) {
+        start = now_ns();
+        if (vols_bin) {
+            update_vols_bin();
+        } else {
+            update_vols();
+        }
+        stats_io(IO_VOLS, start);
+    }
+    if (checkpoint.totals_dirty) {
+        start = now_ns();
+        update_facture();
+        stats_io(IO_FACTURE, start);
+    }
+    // Segments compactables: vols.txt (ou vols.bin) reflète tout le journal
+    // jusqu'à checkpoint.lsn et, avec les points de reprise, checkpoint.txt
+    // aussi; au redémarrage, ils ne seront plus relus
+    uint64_t limit = checkpoint.seats_dirty ? 0 : checkpoint.lsn;
+    if (checkpoint_interval > 0 && checkpoint.checkpoint_lsn < limit) limit = checkpoint.checkpoint_lsn;
+    if (limit > compaction_limit) __atomic_store_n(&compaction_limit, limit, __ATOMIC_RELEASE);
+    stats_unlock(&persist_mutex, LOCK_PERSIST, locked);
+}
+
+// Écrit histo.agg (agrégats des segments compactés jusqu'à lsn)
+int write_aggregates(uint64_t lsn) {
+    char tmp[64];
+    FILE *fp = open_temp_file("histo.agg", tmp, sizeof(tmp));
+    if (!fp) return -1;
+    fprintf(fp, "AGREGATS %llu\n", (unsigned long long)lsn);
+    for (int i = 0; i < num_flights; i++) {
+        FlightAggregate *flight = &aggregates.flights[i];
+        if (flight->transactions == 0) continue;
+        fprintf(fp, "VOL %d %lld %lld %lld\n", flights[i].ref, flight->transactions,
+                flight->booked, flight->cancelled);
+    }
+    for (int i = 0; i < aggregates.num_agencies; i++) {
+        AgencyAggregate *agency = &aggregates.agencies[i];
+        fprintf(fp, "AGENCE %d %lld %lld\n", agency->id, agency->transactions, agency->cents);
+    }
+    return commit_file(fp, tmp, "histo.agg");
+}
+
+// Compacte les segments scellés finissant avant compaction_limit: leurs
+// transactions rejoignent histo.agg, puis ils partent dans archive/ et ne
+// sont plus relus (rejeu, HISTORY, réplicas). Renvoie -1 si histo.agg n'a
+// pas pu être écrit: les agrégats en mémoire ne correspondent plus au
+// fichier, la compaction s'arrête là.
+int compact_segments() {
+    uint64_t limit = __atomic_load_n(&compaction_limit, __ATOMIC_ACQUIRE);
+    pthread_rwlock_rdlock(&segments.lock);
+    int first = segments.first, last = first;
+    while (last < segments.count - 1 && segments.list[last].end <= limit) last++;
+    uint64_t start = segments.list[first].start, end = segments.list[last].start;
+    pthread_rwlock_unlock(&segments.lock);
+    if (last == first) return 0;
+
+    static JournalReader reader;
+    char line[JOURNAL_LINE_MAX];
+    reader.lsn = start;
+    while (journal_next_line(&reader, end, line, sizeof(line)) > 0) aggregate_line(line);
+    if (reader.lsn < end) {
+        fprintf(stderr, "Erreur de lecture du journal à l'octet %llu\n",
+                (unsigned long long)reader.lsn);
+        return -1;
+    }
+    if (write_aggregates(end) < 0) return -1;
+    for (int i = first; i < last; i++) {
+        char path[64];
+        segment_path(path, sizeof(path), segments.list[i].start);
+        archive_segment(path);
+    }
+    sync_directory("archive");
+    sync_directory(".");
+
+    // Les lecteurs cessent de chercher ces positions avant la fermeture
+    __atomic_store_n(&aggregates.lsn, end, __ATOMIC_RELEASE);
+    pthread_rwlock_wrlock(&segments.lock);
+    for (int i = first; i < last; i++) close(segments.list[i].fd);
+    segments.first = last;
+    pthread_rwlock_unlock(&segments.lock);
+    printf("Journal compacté jusqu'à l'octet %llu (%d segment(s) archivé(s))\n",
+           (unsigned long long)end, last - first);
+    return 0;
+}
+
+// Fil de compaction du journal
+void* compaction_thread(void* arg) {
+    while (1) {
+        usleep(flush_interval_ms * 1000);
+        if (compact_segments() < 0) {
+            fprintf(stderr, "Compaction du journal arrêtée\n");
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+void start_compaction() {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, compaction_thread, NULL) != 0) {
+        perror("Erreur lors de la création du thread de compaction");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+}
+
+// Thread de persistance: regroupe les changements et réécrit les fichiers.
+// Entre deux passages, renouvelle la réservation de versions dès qu'elle
+// est demandée.
+void* persistence_thread(void* arg) {
+    while (1) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        add_ms(&deadline, flush_interval_ms);
+        pthread_mutex_lock(&version_mutex);
+        while (!time_reached(&deadline)) {
+            if (__atomic_exchange_n(&version_renew_wanted, 0, __ATOMIC_ACQ_REL)) {
+                pthread_mutex_unlock(&version_mutex);
+                reserve_versions();
+                pthread_mutex_lock(&version_mutex);
+            } else {
+                pthread_cond_timedwait(&version_cond, &version_mutex, &deadline);
+            }
+        }
+        pthread_mutex_unlock(&version_mutex);
+        persist(0);
+    }
+    return NULL;
+}
+
+// Écrit périodiquement le rapport de statistiques dans stats.txt (option -m)
+// pour les outils de supervision; le fichier est remplacé atomiquement
+void* stats_thread(void* arg) {
+    Buffer report = {0};
+    while (1) {
+        sleep(stats_interval);
+        report.len = 0;
+        buffer_printf(&report, "time unix_s=%ld\n", (long)time(NULL));
+        stats_report(&report);
+        char tmp[64];
+        FILE *fp = open_temp_file("stats.txt", tmp, sizeof(tmp));
+        if (!fp) continue;
+        fwrite(report.data, 1, report.len, fp);
+        commit_file(fp, tmp, "stats.txt");
+    }
+    return NULL;
+}
+
+// Charge checkpoint.txt s'il existe et renvoie 1; *lsn reçoit l'offset du
+// journal à partir duquel il faut rejouer
+int load_checkpoint(uint64_t *lsn_out) {
+    FILE *fp = fopen("checkpoint.txt", "r");
+    if (!fp) return 0;
+    char line[256];
+    unsigned long long lsn;
+    if (!fgets(line, sizeof(line), fp) || sscanf(line, "CHECKPOINT %llu", &lsn) != 1) {
+        printf("checkpoint.txt illisible, ignoré\n");
+        fclose(fp);
+        return 0;
+    }
+    if (journal_end() < lsn) {
+        printf("checkpoint.txt plus récent que histo.txt, ignoré\n");
+        fclose(fp);
+        return 0;
+    }
+    if (lsn < aggregates.lsn) {
+        printf("checkpoint.txt antérieur aux segments compactés, ignoré\n");
+        fclose(fp);
+        return 0;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        int ref, seats, agency_id;
+        long long cents;
+        if (sscanf(line, "VOL %d %d", &ref, &seats) == 2) {
+            int i = find_flight_index(ref);
+            if (i != -1) flights[i].available_seats = seats;
+        } else if (sscanf(line, "AGENCE %d %lld", &agency_id, &cents) == 2) {
+            Agency *agency = get_agency(agency_id);
+            if (agency) agency->total_payments = cents;
+        }
+    }
+    fclose(fp);
+    printf("Point de reprise chargé (histo.txt à partir de l'octet %llu)\n", lsn);
+    *lsn_out = lsn;
+    return 1;
+}
+
+// Initialise la copie du point de reprise à partir de l'état rechargé au
+// démarrage, puis lance le thread qui la tient à jour
+void start_persistence() {
+    checkpoint.lsn = journal.acked_lsn;
+    // vols.txt est à réécrire s'il ne reflète pas le journal rejoué
+    checkpoint.seats_dirty = vols_lsn != checkpoint.lsn;
+    checkpoint.seats = malloc((num_flights ? num_flights : 1) * sizeof(int));
+    if (!checkpoint.seats) {
+        perror("Erreur d'allocation du point de reprise");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < num_flights; i++) {
+        checkpoint.seats[i] = flights[i].available_seats;
+    }
+    checkpoint.agency_index = intmap_create(num_agencies);
+    for (int i = 0; i < num_agencies; i++) {
+        Agency *agency = &agency_chunks[i / AGENCY_CHUNK_SIZE][i % AGENCY_CHUNK_SIZE];
+        checkpoint_add_payment(agency->id, agency->total_payments);
+    }
+    if (checkpoint_interval > 0) persist(1);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, persistence_thread, NULL) != 0) {
+        perror("Erreur lors de la création du thread de persistance");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+}
+
+void buffer_put_u32(Buffer *buf, uint32_t v) {
+    unsigned char bytes[4];
+    put_u32(bytes, v);
+    buffer_append(buf, (const char *)bytes, 4);
+}
+
+void buffer_put_u64(Buffer *buf, uint64_t v) {
+    unsigned char bytes[8];
+    put_u64(bytes, v);
+    buffer_append(buf, (const char *)bytes, 8);
+}
+
+// Ligne d'un vol dans une réponse CONSULT
+void put_flight_text(Buffer *out, Flight *flight) {
+    buffer_printf(out, "%d %s %d %d\n", flight->ref, flight->destination,
+                  get_seats(flight), flight->price);
+}
+
+// Entrée d'un vol dans une réponse OP_CONSULT
+void put_flight_binary(Buffer *out, Flight *flight) {
+    unsigned char dest_len = strnlen(flight->destination, sizeof(flight->destination));
+    buffer_put_u32(out, flight->ref);
+    buffer_put_u32(out, get_seats(flight));
+    buffer_put_u32(out, flight->price);
+    buffer_append(out, (const char *)&dest_len, 1);
+    buffer_append(out, flight->destination, dest_len);
+}
+
+void catalogue_release(Catalogue *cat) {
+    if (__atomic_sub_fetch(&cat->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        buffer_free(&cat->text);
+        buffer_free(&cat->binary);
+        free(cat);
+    }
+}
+
+// Renvoie le catalogue de la version publiée, reconstruit seulement si des
+// places ont changé depuis le précédent. À rendre avec catalogue_release.
+// Les places lues peuvent être plus récentes que la version annoncée: un
+// client qui redemande depuis cette version reçoit alors ces vols à nouveau.
+Catalogue *catalogue_acquire() {
+    uint64_t version = published_version();
+    uint64_t locked = stats_lock(&catalogue_mutex, LOCK_CATALOGUE);
+    if (!catalogue || catalogue->version != version) {
+        Catalogue *cat = calloc(1, sizeof(Catalogue));
+        if (!cat) {
+            perror("Erreur d'allocation du catalogue");
+            exit(EXIT_FAILURE);
+        }
+        cat->version = version;
+        cat->refs = 1;
+        buffer_put_u32(&cat->binary, num_flights);
+        for (int i = 0; i < num_flights; i++) {
+            put_flight_text(&cat->text, &flights[i]);
+            put_flight_binary(&cat->binary, &flights[i]);
+        }
+        if (catalogue) catalogue_release(catalogue);
+        catalogue = cat;
+    }
+    Catalogue *cat = catalogue;
+    __atomic_add_fetch(&cat->refs, 1, __ATOMIC_ACQ_REL);
+    stats_unlock(&catalogue_mutex, LOCK_CATALOGUE, locked);
+    return cat;
+}
+
+// Ajoute la version publiée puis les vols modifiés après la version since
+void consult_since(uint64_t since, Buffer *out, int binary) {
+    uint64_t version = published_version();
+    if (binary) {
+        buffer_put_u64(out, version);
+        size_t count_offset = out->len;
+        uint32_t count = 0;
+        buffer_put_u32(out, 0);
+        for (int i = 0; i < num_flights; i++) {
+            if (__atomic_load_n(&flight_versions[i], __ATOMIC_ACQUIRE) <= since) continue;
+            put_flight_binary(out, &flights[i]);
+            count++;
+        }
+        put_u32((unsigned char *)out->data + count_offset, count);
+    } else {
+        buffer_printf(out, "VERSION %llu\n", (unsigned long long)version);
+        for (int i = 0; i < num_flights; i++) {
+            if (__atomic_load_n(&flight_versions[i], __ATOMIC_ACQUIRE) <= since) continue;
+            put_flight_text(out, &flights[i]);
+        }
+    }
+}
+
+// Critères d'une recherche SEARCH
+typedef struct {
+    char destination[50]; // "" pour toutes
+    int min_seats;
+    long long min_price;
+    long long max_price;
+    int order;            // SEARCH_BY_*
+    int limit;            // 0: pas de limite
+} SearchQuery;
+
+// Vol retenu, avec les places lues au moment du filtrage
+typedef struct {
+    int idx;
+    int seats;
+} SearchMatch;
+
+int compare_flights_by_price(const void *a, const void *b) {
+    const Flight *x = &flights[*(const int *)a], *y = &flights[*(const int *)b];
+    if (x->price != y->price) return (x->price > y->price) - (x->price < y->price);
+    return (x->ref > y->ref) - (x->ref < y->ref);
+}
+
+int compare_flights_by_destination(const void *a, const void *b) {
+    int cmp = strcmp(flights[*(const int *)a].destination, flights[*(const int *)b].destination);
+    return cmp != 0 ? cmp : compare_flights_by_price(a, b);
+}
+
+int compare_matches_by_seats(const void *a, const void *b) {
+    const SearchMatch *x = a, *y = b;
+    if (x->seats != y->seats) return (x->seats < y->seats) - (x->seats > y->seats);
+    return compare_flights_by_price(&x->idx, &y->idx);
+}
+
+int compare_matches_by_ref(const void *a, const void *b) {
+    int x = flights[((const SearchMatch *)a)->idx].ref, y = flights[((const SearchMatch *)b)->idx].ref;
+    return (x > y) - (x < y);
+}
+
+// Construit les index de SEARCH (une fois les vols chargés)
+void build_search_indexes() {
+    flights_by_price = malloc((num_flights ? num_flights : 1) * sizeof(int));
+    flights_by_destination = malloc((num_flights ? num_flights : 1) * sizeof(int));
+    if (!flights_by_price || !flights_by_destination) {
+        perror("Erreur d'allocation des index de recherche");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < num_flights; i++) flights_by_price[i] = flights_by_destination[i] = i;
+    qsort(flights_by_price, num_flights, sizeof(int), compare_flights_by_price);
+    qsort(flights_by_destination, num_flights, sizeof(int), compare_flights_by_destination);
+}
+
+// Première position d'un index trié (par destination si destination n'est
+// pas NULL, puis par prix) dont la clé est >= (destination, price)
+int search_bound(const int *order, const char *destination, long long price) {
+    int low = 0, high = num_flights;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        const Flight *flight = &flights[order[mid]];
+        int cmp = destination ? strcmp(flight->destination, destination) : 0;
+        if (cmp < 0 || (cmp == 0 && flight->price < price)) low = mid + 1;
+        else high = mid;
+    }
+    return low;
+}
+
+// Ajoute à out les vols correspondant à query (texte comme CONSULT, FAILURE
+// si aucun, ou charge utile OP_CONSULT). Seule la plage de l'index couvrant la
+// destination et les prix demandés est parcourue; un tri par prix
+// s'arrête dès que limit vols sont trouvés.
+void search_flights(const SearchQuery *query, Buffer *out, int binary) {
+    const char *destination = query->destination[0] ? query->destination : NULL;
+    const int *order = destination ? flights_by_destination : flights_by_price;
+    int begin = search_bound(order, destination, query->min_price);
+    int end = query->max_price < query->min_price ? begin
+            : search_bound(order, destination, query->max_price + 1);
+    int by_price = query->order == SEARCH_BY_PRICE || query->order == SEARCH_BY_PRICE_DESC;
+    int wanted = query->limit > 0 && by_price ? query->limit : end - begin;
+
+    SearchMatch *matches = malloc((end > begin ? end - begin : 1) * sizeof(SearchMatch));
+    if (!matches) return;
+    int count = 0;
+    for (int i = 0; i < end - begin && count < wanted; i++) {
+        int idx = order[query->order == SEARCH_BY_PRICE_DESC ? end - 1 - i : begin + i];
+        int seats = get_seats(&flights[idx]);
+        if (seats >= query->min_seats) {
+            matches[count].idx = idx;
+            matches[count].seats = seats;
+            count++;
+        }
+    }
+    if (query->order == SEARCH_BY_SEATS) {
+        qsort(matches, count, sizeof(SearchMatch), compare_matches_by_seats);
+    } else if (query->order == SEARCH_BY_REF) {
+        qsort(matches, count, sizeof(SearchMatch), compare_matches_by_ref);
+    }
+    if (query->limit > 0 && count > query->limit) count = query->limit;
+    if (!binary && count == 0) buffer_append(out, "FAILURE", 7); // Jamais de réponse vide
+
+    if (binary) buffer_put_u32(out, count);
+    for (int i = 0; i < count; i++) {
+        Flight flight = flights[matches[i].idx];
+        flight.available_seats = matches[i].seats; // Les places filtrées
+        if (binary) put_flight_binary(out, &flight);
+        else put_flight_text(out, &flight);
+    }
+    free(matches);
+}
+
+// Analyse les critères texte de SEARCH: destination=X seats>=N price>=N
+// price<=N sort=price|-price|seats|ref limit=N (dans n'importe quel ordre).
+// Renvoie 0 si un critère est invalide.
+int parse_search(const char *args, SearchQuery *query) {
+    memset(query, 0, sizeof(*query));
+    query->max_price = INT_MAX;
+    query->min_price = INT_MIN;
+    char token[64];
+    int used;
+    while (sscanf(args, "%63s%n", token, &used) == 1) {
+        args += used;
+        char order[16];
+        if (sscanf(token, "destination=%49s", query->destination) == 1 ||
+            sscanf(token, "seats>=%d", &query->min_seats) == 1 ||
+            sscanf(token, "price>=%lld", &query->min_price) == 1 ||
+            sscanf(token, "price<=%lld", &query->max_price) == 1 ||
+            sscanf(token, "limit=%d", &query->limit) == 1) {
+            continue;
+        }
+        if (sscanf(token, "sort=%15s", order) != 1) return 0;
+        if (strcmp(order, "price") == 0) query->order = SEARCH_BY_PRICE;
+        else if (strcmp(order, "-price") == 0) query->order = SEARCH_BY_PRICE_DESC;
+        else if (strcmp(order, "seats") == 0) query->order = SEARCH_BY_SEATS;
+        else if (strcmp(order, "ref") == 0) query->order = SEARCH_BY_REF;
+        else return 0;
+    }
+    return query->limit >= 0;
+}
+
+// Réserve value places pour une agence et journalise la demande.
+// Seul le vol concerné est modifié (atomiquement): deux requêtes sur des vols
+// différents ne se bloquent jamais. *lsn reçoit la position du journal qui
+// doit être durable avant de répondre.
+int reserve(int ref, int agency_id, int value, uint64_t *lsn) {
+    if (value <= 0) return ST_INVALID; // Un nombre négatif rendrait des places
+    Agency *agency = get_agency(agency_id);
+    if (!agency) return ST_SERVER_ERROR;
+    int admitted = admit(agency);
+    if (admitted != ST_SUCCESS) return admitted;
+
+    int flight_idx = find_flight_index(ref);
+    Flight *flight = flight_idx != -1 ? &flights[flight_idx] : NULL;
+    if (flight && try_reserve_seats(flight, value)) {
+        add_payment(agency, reserve_cost(flight, value));
+        *lsn = journal_append(ref, agency_id, "Demande", value, "succès");
+        return ST_SUCCESS;
+    }
+    *lsn = journal_append(ref, agency_id, "Demande", value, "impossible");
+    return ST_FAILURE;
+}
+
+// Annule value places (remboursées à 90%) et journalise l'annulation
+int cancel(int ref, int agency_id, int value, uint64_t *lsn) {
+    if (value <= 0) return ST_INVALID;
+    Agency *agency = get_agency(agency_id);
+    if (!agency) return ST_SERVER_ERROR;
+    int admitted = admit(agency);
+    if (admitted != ST_SUCCESS) return admitted;
+
+    int flight_idx = find_flight_index(ref);
+    if (flight_idx == -1) return ST_FAILURE;
+    Flight *flight = &flights[flight_idx];
+    add_seats(flight, value);
+    add_payment(agency, -cancel_refund(flight, value));
+    *lsn = journal_append(ref, agency_id, "Annulation", value, "succès");
+    return ST_SUCCESS;
+}
+
+Hold *hold_at(uint32_t slot) {
+    return &hold_chunks[slot / HOLD_CHUNK_SIZE][slot % HOLD_CHUNK_SIZE];
+}
+
+// Prend un emplacement de blocage libre (NULL si la table est pleine)
+Hold *hold_alloc() {
+    Hold *hold = NULL;
+    uint64_t locked = stats_lock(&holds_mutex, LOCK_HOLDS);
+    if (free_holds) {
+        hold = free_holds;
+        free_holds = hold->next;
+    } else if (num_holds < (uint32_t)HOLD_CHUNK_SIZE * HOLD_MAX_CHUNKS) {
+        Hold **chunk = &hold_chunks[num_holds / HOLD_CHUNK_SIZE];
+        if (!*chunk) *chunk = calloc(HOLD_CHUNK_SIZE, sizeof(Hold));
+        if (*chunk) {
+            hold = hold_at(num_holds);
+            hold->slot = num_holds;
+            __atomic_store_n(&num_holds, num_holds + 1, __ATOMIC_RELEASE);
+        }
+    }
+    stats_unlock(&holds_mutex, LOCK_HOLDS, locked);
+    return hold;
+}
+
+// Bloque value places pour ttl secondes. *hold_id reçoit l'identifiant à
+// passer à CONFIRM ou RELEASE.
+int hold_seats(int ref, int agency_id, int value, int ttl, uint64_t *hold_id) {
+    if (value <= 0 || ttl <= 0) return ST_INVALID;
+    int flight_idx = find_flight_index(ref);
+    if (flight_idx == -1) return ST_FAILURE;
+    Agency *agency = get_agency(agency_id);
+    if (!agency) return ST_SERVER_ERROR;
+    int admitted = admit(agency);
+    if (admitted != ST_SUCCESS) return admitted;
+    Hold *hold = hold_alloc();
+    if (!hold) return ST_SERVER_ERROR;
+    if (!try_reserve_seats(&flights[flight_idx], value)) {
+        // Rendu tel quel: personne d'autre ne connaît cet emplacement
+        uint64_t locked = stats_lock(&holds_mutex, LOCK_HOLDS);
+        hold->next = free_holds;
+        free_holds = hold;
+        stats_unlock(&holds_mutex, LOCK_HOLDS, locked);
+        return ST_FAILURE;
+    }
+    uint64_t max_ticks = ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+    uint64_t ticks = (uint64_t)ttl * 1000 / HOLD_TICK_MS;
+    hold->flight_idx = flight_idx;
+    hold->agency = agency;
+    hold->seats = value;
+    hold->expires = __atomic_load_n(&hold_tick, __ATOMIC_RELAXED) + (ticks < max_ticks ? ticks : max_ticks);
+    uint64_t generation = hold->status >> 8;
+    __atomic_add_fetch(&active_holds, 1, __ATOMIC_RELAXED);
+    *hold_id = generation << 32 | hold->slot;
+
+    // Confié au thread des expirations, seul à toucher la roue, avant d'être
+    // en cours: un CONFIRM ou un RELEASE le trouve toujours déjà confié
+    Hold *head = __atomic_load_n(&new_holds, __ATOMIC_RELAXED);
+    do {
+        hold->next = head;
+    } while (!__atomic_compare_exchange_n(&new_holds, &head, hold, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    __atomic_store_n(&hold->status, generation << 8 | HOLD_HELD, __ATOMIC_RELEASE);
+    return ST_SUCCESS;
+}
+
+// Termine le blocage hold_id s'il est encore en cours (un seul gagnant entre
+// CONFIRM, RELEASE et l'expiration). Renvoie 0 sinon. Les champs du blocage
+// sont copiés dans *copy: le thread des expirations le retire de la roue et
+// recycle son emplacement dès son prochain tick.
+int hold_finish(uint64_t hold_id, Hold *copy) {
+    uint32_t slot = hold_id & 0xffffffff;
+    if (slot >= __atomic_load_n(&num_holds, __ATOMIC_ACQUIRE)) return 0;
+    Hold *hold = hold_at(slot);
+    uint64_t held = (hold_id >> 32) << 8 | HOLD_HELD;
+    if (__atomic_load_n(&hold->status, __ATOMIC_ACQUIRE) != held) return 0;
+    *copy = *hold; // Valable si le compare-and-swap réussit: même génération
+    if (!__atomic_compare_exchange_n(&hold->status, &held, (held & ~(uint64_t)0xff) | HOLD_DONE,
+                                     0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+    __atomic_sub_fetch(&active_holds, 1, __ATOMIC_RELAXED);
+    Hold *head = __atomic_load_n(&finished_holds, __ATOMIC_RELAXED);
+    do {
+        hold->finished_next = head;
+    } while (!__atomic_compare_exchange_n(&finished_holds, &head, hold, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return 1;
+}
+
+// Transforme un blocage en réservation: facturée et journalisée comme RESERVE
+int confirm_hold(uint64_t hold_id, uint64_t *lsn) {
+    Hold hold;
+    int admitted = admit(NULL);
+    if (admitted != ST_SUCCESS) return admitted; // Le blocage reste en cours
+    if (!hold_finish(hold_id, &hold)) return ST_FAILURE;
+    Flight *flight = &flights[hold.flight_idx];
+    add_payment(hold.agency, reserve_cost(flight, hold.seats));
+    *lsn = journal_append(flight->ref, hold.agency->id, "Demande", hold.seats, "succès");
+    return ST_SUCCESS;
+}
+
+// Rend les places d'un blocage, sans pénalité ni journalisation
+int release_hold(uint64_t hold_id) {
+    Hold hold;
+    if (!hold_finish(hold_id, &hold)) return ST_FAILURE;
+    add_seats(&flights[hold.flight_idx], hold.seats);
+    return ST_SUCCESS;
+}
+
+// Roue temporelle hiérarchique (à la Varghese et Lauck): niveau l, case
+// (expires >> (l * WHEEL_BITS)) & 63. Un blocage est placé au niveau le plus
+// fin couvrant son échéance; quand le niveau 0 fait un tour, la case suivante
+// du niveau 1 est redistribuée plus finement, et ainsi de suite. Chaque tick
+// ne traite que les blocages qui expirent, quel que soit leur nombre.
+typedef struct {
+    Hold *slots[WHEEL_LEVELS][1 << WHEEL_BITS];
+    uint64_t now;
+} TimerWheel;
+
+// Place un blocage d'échéance >= now (== now: ramassé par ce tick)
+void wheel_insert(TimerWheel *wheel, Hold *hold) {
+    uint64_t delta = hold->expires - wheel->now;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >> (WHEEL_BITS * (level + 1))) level++;
+    Hold **slot = &wheel->slots[level][(hold->expires >> (WHEEL_BITS * level)) &
+                                       ((1 << WHEEL_BITS) - 1)];
+    hold->next = *slot;
+    if (*slot) (*slot)->pprev = &hold->next;
+    *slot = hold;
+    hold->pprev = slot;
+    hold->in_wheel = 1;
+}
+
+// Retire un blocage de sa case, avant son échéance
+void wheel_remove(Hold *hold) {
+    *hold->pprev = hold->next;
+    if (hold->next) hold->next->pprev = hold->pprev;
+    hold->in_wheel = 0;
+}
+
+// Avance d'un tick; renvoie la liste des blocages arrivés à échéance
+Hold *wheel_advance(TimerWheel *wheel) {
+    wheel->now++;
+    int mask = (1 << WHEEL_BITS) - 1;
+    // Redistribue les niveaux supérieurs dont la case commence à ce tick
+    for (int level = 1; level < WHEEL_LEVELS; level++) {
+        if ((wheel->now >> (WHEEL_BITS * (level - 1))) & mask) break;
+        Hold **slot = &wheel->slots[level][(wheel->now >> (WHEEL_BITS * level)) & mask];
+        Hold *list = *slot;
+        *slot = NULL;
+        while (list) {
+            Hold *next = list->next;
+            wheel_insert(wheel, list);
+            list = next;
+        }
+    }
+    Hold **slot = &wheel->slots[0][wheel->now & mask];
+    Hold *expired = *slot;
+    *slot = NULL;
+    return expired;
+}
+
+// Remet un emplacement terminé dans la liste libre, avec une nouvelle
+// génération: les identifiants de ce blocage sont périmés
+void hold_recycle(Hold *hold, Hold **recycled, Hold **last) {
+    uint64_t status = __atomic_load_n(&hold->status, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&hold->status, ((status >> 8) + 1) << 8 | HOLD_FREE, __ATOMIC_RELEASE);
+    hold->next = *recycled;
+    *recycled = hold;
+    if (!*last) *last = hold;
+}
+
+// Thread des expirations: place les nouveaux blocages dans la roue, retire
+// ceux que CONFIRM ou RELEASE ont terminés, rend les places des blocages
+// expirés et recycle les emplacements
+void* hold_thread(void* arg) {
+    TimerWheel *wheel = calloc(1, sizeof(TimerWheel));
+    if (!wheel) {
+        perror("Erreur d'allocation de la roue des blocages");
+        exit(EXIT_FAILURE);
+    }
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (1) {
+        next.tv_nsec += HOLD_TICK_MS * 1000000L;
+        if (next.tv_nsec >= 1000000000) {
+            next.tv_sec++;
+            next.tv_nsec -= 1000000000;
+        }
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR);
+
+        // Les terminés d'abord: chacun a été confié avant d'être en cours, il
+        // est donc dans la roue ou parmi les nouveaux pris juste après
+        Hold *finished = __atomic_exchange_n(&finished_holds, NULL, __ATOMIC_ACQUIRE);
+        Hold *added = __atomic_exchange_n(&new_holds, NULL, __ATOMIC_ACQUIRE);
+        while (added) {
+            Hold *following = added->next;
+            if (added->expires <= wheel->now) added->expires = wheel->now + 1; // Tick déjà passé
+            wheel_insert(wheel, added);
+            added = following;
+        }
+        Hold *recycled = NULL, *last = NULL;
+        while (finished) {
+            Hold *hold = finished;
+            finished = hold->finished_next;
+            if (hold->in_wheel) wheel_remove(hold);
+            hold_recycle(hold, &recycled, &last);
+        }
+        Hold *expired = wheel_advance(wheel);
+        __atomic_store_n(&hold_tick, wheel->now, __ATOMIC_RELAXED);
+
+        while (expired) {
+            Hold *hold = expired;
+            expired = hold->next;
+            hold->in_wheel = 0;
+            uint64_t status = __atomic_load_n(&hold->status, __ATOMIC_ACQUIRE);
+            if ((status & 0xff) == HOLD_FREE) {
+                // Confié mais pas encore en cours (HOLD plus court qu'un tick)
+                hold->expires = wheel->now + 1;
+                wheel_insert(wheel, hold);
+            } else if ((status & 0xff) == HOLD_HELD &&
+                __atomic_compare_exchange_n(&hold->status, &status, (status & ~(uint64_t)0xff) | HOLD_DONE,
+                                            0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+                add_seats(&flights[hold->flight_idx], hold->seats);
+                __atomic_sub_fetch(&active_holds, 1, __ATOMIC_RELAXED);
+                hold_recycle(hold, &recycled, &last);
+            }
+            // Sinon terminé par CONFIRM ou RELEASE: recyclé quand sa demande
+            // de retrait arrivera
+        }
+        if (recycled) {
+            uint64_t locked = stats_lock(&holds_mutex, LOCK_HOLDS);
+            last->next = free_holds;
+            free_holds = recycled;
+            stats_unlock(&holds_mutex, LOCK_HOLDS, locked);
+        }
+    }
+    return NULL;
+}
+
+void start_holds() {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, hold_thread, NULL) != 0) {
+        perror("Erreur lors de la création du thread des blocages");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+}
+
+// Réserve tous les vols d'un itinéraire, ou aucun. Chaque vol est pris par
+// compare-and-swap comme pour RESERVE; si l'un manque de places, ceux déjà
+// pris sont rendus (sans pénalité). Le lot est facturé une fois et journalisé
+// sur une seule ligne, donc rendu durable (ou perdu) d'un bloc.
+int reserve_batch(int agency_id, const int *refs, const int *values, int legs, uint64_t *lsn) {
+    if (legs <= 0 || legs > MAX_BATCH_LEGS) return ST_INVALID;
+    Flight *legs_flights[MAX_BATCH_LEGS];
+    for (int i = 0; i < legs; i++) {
+        if (values[i] <= 0) return ST_INVALID;
+        for (int j = 0; j < i; j++) {
+            if (refs[j] == refs[i]) return ST_INVALID; // Un vol par étape
+        }
+        int flight_idx = find_flight_index(refs[i]);
+        if (flight_idx == -1) return ST_FAILURE;
+        legs_flights[i] = &flights[flight_idx];
+    }
+    Agency *agency = get_agency(agency_id);
+    if (!agency) return ST_SERVER_ERROR;
+    int admitted = admit(agency);
+    if (admitted != ST_SUCCESS) return admitted;
+
+    long long cents = 0;
+    for (int i = 0; i < legs; i++) {
+        if (!try_reserve_seats(legs_flights[i], values[i])) {
+            while (--i >= 0) add_seats(legs_flights[i], values[i]);
+            *lsn = journal_append_legs(refs, values, legs, agency_id, "Lot", "impossible");
+            return ST_FAILURE;
+        }
+        cents += reserve_cost(legs_flights[i], values[i]);
+    }
+    add_payment(agency, cents);
+    *lsn = journal_append_legs(refs, values, legs, agency_id, "Lot", "succès");
+    return ST_SUCCESS;
+}
+
+// Réponse texte correspondant à un code ST_*
+const char *status_text(int status) {
+    switch (status) {
+    case ST_SUCCESS: return "SUCCESS";
+    case ST_FAILURE: return "FAILURE";
+    case ST_INVALID: return "INVALID_COMMAND";
+    case ST_UNKNOWN: return "UNKNOWN_COMMAND";
+    case ST_BUSY: return "BUSY";
+    case ST_READ_ONLY: return "READ_ONLY";
+    default: return "SERVER_ERROR";
+    }
+}
+
+// Page de l'historique pour HISTORY (texte: lignes puis "NEXT curseur" ou
+// "END"; binaire: curseur suivant puis lignes)
+void history_command(int kind, long long key, long long to, uint32_t cursor, int limit,
+                     Buffer *out, int binary) {
+    if (limit <= 0 || limit > HISTORY_PAGE_MAX) limit = limit <= 0 ? HISTORY_PAGE_DEFAULT : HISTORY_PAGE_MAX;
+    size_t start = out->len;
+    if (binary) buffer_put_u32(out, 0);
+    uint32_t next = history_query(kind, key, to, cursor, limit, out);
+    if (binary) {
+        put_u32((unsigned char *)out->data + start, next);
+    } else if (next > 0) {
+        buffer_printf(out, "NEXT %u", next);
+    } else {
+        buffer_append(out, "END", 3);
+    }
+}
+
+// Suite du journal pour une réplique (OP_JOURNAL): fin durable de histo.txt,
+// puis ses lignes complètes à partir de from (au plus max octets)
+int journal_read(uint64_t from, uint32_t max, Buffer *out) {
+    pthread_mutex_lock(&journal.lock);
+    uint64_t end = journal.acked_lsn;
+    pthread_mutex_unlock(&journal.lock);
+    if (from > end) return ST_INVALID; // Pas ce journal-là
+    if (from < __atomic_load_n(&aggregates.lsn, __ATOMIC_ACQUIRE)) return ST_FAILURE; // Compacté
+    if (max > REPLICA_CHUNK) max = REPLICA_CHUNK;
+    if (max < JOURNAL_LINE_MAX) max = JOURNAL_LINE_MAX;
+    size_t size = end - from < max ? end - from : max;
+    buffer_put_u64(out, end);
+    buffer_reserve(out, size);
+    ssize_t n = size > 0 ? journal_pread(out->data + out->len, size, from) : 0;
+    if (n < 0) {
+        out->len -= 8;
+        return ST_SERVER_ERROR;
+    }
+    while (n > 0 && out->data[out->len + n - 1] != '\n') n--; // Dernière ligne coupée
+    out->len += n;
+    return ST_SUCCESS;
+}
+
+// Exécute la commande texte command, d'arguments args (voir process_request)
+uint64_t execute_command(const char *command, const char *args, Buffer *out) {
+    uint64_t lsn = 0;
+    if (strcmp(command, "RESERVE") == 0 || strcmp(command, "CANCEL") == 0) {
+        int ref, agency_id, value;
+        int parsed = sscanf(args, "%d %d %d", &ref, &agency_id, &value);
+        if (parsed != 3) {
+            buffer_append(out, "INVALID_COMMAND", 15);
+            return 0;
+        }
+        int status = strcmp(command, "RESERVE") == 0 ? reserve(ref, agency_id, value, &lsn)
+                                                     : cancel(ref, agency_id, value, &lsn);
+        const char *reply = status_text(status);
+        buffer_append(out, reply, strlen(reply));
+    } else if (strcmp(command, "RESERVE_BATCH") == 0) {
+        // RESERVE_BATCH agence ref places [ref places ...]
+        int agency_id, refs[MAX_BATCH_LEGS], values[MAX_BATCH_LEGS], legs = 0, used;
+        int valid = sscanf(args, "%d%n", &agency_id, &used) == 1;
+        args += valid ? used : 0;
+        while (valid && legs < MAX_BATCH_LEGS &&
+               sscanf(args, "%d %d%n", &refs[legs], &values[legs], &used) == 2) {
+            args += used;
+            legs++;
+        }
+        while (*args == ' ' || *args == '\n' || *args == '\r') args++;
+        if (!valid || legs == 0 || *args) {
+            buffer_append(out, "INVALID_COMMAND", 15);
+            return 0;
+        }
+        const char *reply = status_text(reserve_batch(agency_id, refs, values, legs, &lsn));
+        buffer_append(out, reply, strlen(reply));
+    } else if (strcmp(command, "HOLD") == 0) {
+        int ref, agency_id, value, ttl;
+        if (sscanf(args, "%d %d %d %d", &ref, &agency_id, &value, &ttl) != 4) {
+            buffer_append(out, "INVALID_COMMAND", 15);
+            return 0;
+        }
+        uint64_t hold_id;
+        int status = hold_seats(ref, agency_id, value, ttl, &hold_id);
+        if (status == ST_SUCCESS) {
+            buffer_printf(out, "HOLD %llu", (unsigned long long)hold_id);
+        } else {
+            const char *reply = status_text(status);
+            buffer_append(out, reply, strlen(reply));
+        }
+    } else if (strcmp(command, "CONFIRM") == 0 || strcmp(command, "RELEASE") == 0) {
+        unsigned long long hold_id;
+        if (sscanf(args, "%llu", &hold_id) != 1) {
+            buffer_append(out, "INVALID_COMMAND", 15);
+            return 0;
+        }
+        int status = strcmp(command, "CONFIRM") == 0 ? confirm_hold(hold_id, &lsn)
+                                                     : release_hold(hold_id);
+        const char *reply = status_text(status);
+        buffer_append(out, reply, strlen(reply));
+    } else if (strcmp(command, "INVOICE") == 0) {
+        int agency_id;
+        int parsed = sscanf(args, "%d", &agency_id);
+        if (parsed != 1) {
+            buffer_append(out, "INVALID_COMMAND", 15);
+            return 0;
+        }
+        buffer_printf(out, "INVOICE %.2f", get_payment(agency_id));
+    } else if (strcmp(command, "CONSULT") == 0) {
+        Catalogue *cat = catalogue_acquire();
+        buffer_append(out, cat->text.data, cat->text.len);
+        catalogue_release(cat);
+    } else if (strcmp(command, "CONSULT_SINCE") == 0) {
+        unsigned long long since;
+        if (sscanf(args, "%llu", &since) != 1) {
+            buffer_append(out, "INVALID_COMMAND", 15);
+            return 0;
+        }
+        consult_since(since, out, 0);
+    } else if (strcmp(command, "STATS") == 0) {
+        stats_report(out);
+    } else if (strcmp(command, "SEARCH") == 0) {
+        SearchQuery query;
+        if (!parse_search(args, &query)) {
+            buffer_append(out, "INVALID_COMMAND", 15);
+            return 0;
+        }
+        search_flights(&query, out, 0);
+    } else if (strcmp(command, "HISTORY") == 0) {
+        // HISTORY ALL|AGENCY id|FLIGHT ref|TIME début fin [curseur [nombre]]
+        char kind_name[16] = "";
+        long long key = 0, to = 0;
+        unsigned int cursor = 0;
+        int limit = 0, kind, parsed;
+        sscanf(args, "%15s", kind_name);
+        if (strcmp(kind_name, "ALL") == 0) {
+            kind = HISTORY_ALL;
+            sscanf(args, "%*s %u %d", &cursor, &limit);
+            parsed = 1;
+        } else if (strcmp(kind_name, "AGENCY") == 0 || strcmp(kind_name, "FLIGHT") == 0) {
+            kind = kind_name[0] == 'A' ? HISTORY_AGENCY : HISTORY_FLIGHT;
+            parsed = sscanf(args, "%*s %lld %u %d", &key, &cursor, &limit) >= 1;
+        } else {
+            kind = HISTORY_TIME;
+            parsed = strcmp(kind_name, "TIME") == 0 &&
+                     sscanf(args, "%*s %lld %lld %u %d", &key, &to, &cursor, &limit) >= 2;
+        }
+        if (!parsed) {
+            buffer_append(out, "INVALID_COMMAND", 15);
+            return 0;
+        }
+        history_command(kind, key, to, cursor, limit, out, 0);
+    } else {
+        buffer_append(out, "UNKNOWN_COMMAND", 15);
+    }
+
+    return lsn;
+}
+
+// Exécute une commande texte d'agence (TCP ou UDP) et ajoute la réponse dans
+// out. Renvoie la position du journal qui doit être durable avant d'envoyer
+// la réponse (0 si rien n'a été journalisé).
+uint64_t process_request(const char *buffer, Buffer *out) {
+    uint64_t start = now_ns();
+    char command[20] = "";
+    sscanf(buffer, "%19s", command);
+    uint64_t lsn = execute_command(command, buffer + strlen(command), out);
+
+    int kind = 0;
+    while (kind < CMD_OTHER && strcmp(command, command_names[kind]) != 0) kind++;
+    stats_command(kind, start);
+    return lsn;
+}
+
+// Réserve la place de l'en-tête d'une trame réponse; renvoie son offset
+size_t frame_begin(Buffer *out) {
+    size_t start = out->len;
+    buffer_reserve(out, FRAME_HEADER_SIZE);
+    out->len += FRAME_HEADER_SIZE;
+    return start;
+}
+
+// Remplit l'en-tête une fois la charge utile ajoutée
+void frame_end(Buffer *out, size_t start, int opcode, int status, uint32_t request_id) {
+    encode_frame_header((unsigned char *)out->data + start, opcode, status, request_id,
+                        out->len - start - FRAME_HEADER_SIZE);
+}
+
+// Sert une réplique connectée au port de réplication: des OP_JOURNAL, et
+// rien d'autre
+void* replication_client(void* arg) {
+    int fd = (int)(intptr_t)arg;
+    Buffer out = {0};
+    unsigned char header[FRAME_HEADER_SIZE], payload[12];
+    int opcode, status;
+    uint32_t request_id, length;
+    while (recv_exact(fd, header, sizeof(header)) == 0) {
+        decode_frame_header(header, &opcode, &status, &request_id, &length);
+        if (header[0] != FRAME_MAGIC || opcode != OP_JOURNAL || length != sizeof(payload) ||
+            recv_exact(fd, payload, sizeof(payload)) < 0) {
+            break;
+        }
+        out.len = 0;
+        size_t start = frame_begin(&out);
+        status = journal_read(get_u64(payload), get_u32(payload + 8), &out);
+        frame_end(&out, start, OP_JOURNAL, status, request_id);
+        if (send(fd, out.data, out.len, MSG_NOSIGNAL) != (ssize_t)out.len) break;
+    }
+    close(fd);
+    buffer_free(&out);
+    return NULL;
+}
+
+// Port de réplication (-J): séparé du port des agences, qui ne sert jamais
+// le journal. Les répliques sont peu nombreuses: un thread chacune.
+void* replication_listener(void* arg) {
+    int sock = (int)(intptr_t)arg;
+    while (1) {
+        int fd = accept(sock, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR) perror("Erreur lors de l'acceptation d'une réplique");
+            continue;
+        }
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, replication_client, (void *)(intptr_t)fd) != 0) {
+            perror("Erreur lors de la création du thread de réplication");
+            close(fd);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    return NULL;
+}
+
+void start_replication() {
+    struct sockaddr_in addr;
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(replication_port);
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    int opt = 1;
+    if (sock < 0 || setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+        bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(sock, 16) < 0) {
+        perror("Erreur lors de l'ouverture du port de réplication");
+        exit(EXIT_FAILURE);
+    }
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, replication_listener, (void *)(intptr_t)sock) != 0) {
+        perror("Erreur lors de la création du thread de réplication");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+    printf("Journal servi aux répliques sur le port %d\n", replication_port);
+}
+
+// Catégorie statistique d'une requête binaire
+int frame_command(int opcode) {
+    switch (opcode) {
+    case OP_RESERVE: return CMD_RESERVE;
+    case OP_CANCEL: return CMD_CANCEL;
+    case OP_INVOICE: return CMD_INVOICE;
+    case OP_CONSULT: return CMD_CONSULT;
+    case OP_CONSULT_SINCE: return CMD_CONSULT_SINCE;
+    case OP_STATS: return CMD_STATS;
+    case OP_HISTORY: return CMD_HISTORY;
+    case OP_SEARCH: return CMD_SEARCH;
+    case OP_RESERVE_BATCH: return CMD_RESERVE_BATCH;
+    case OP_HOLD: return CMD_HOLD;
+    case OP_CONFIRM: return CMD_CONFIRM;
+    case OP_RELEASE: return CMD_RELEASE;
+    default: return CMD_OTHER;
+    }
+}
+
+// Exécute une requête du protocole binaire et ajoute la trame réponse dans
+// out. Renvoie la position du journal à attendre, comme process_request.
+uint64_t process_frame(int opcode, uint32_t request_id, const unsigned char *payload,
+                       uint32_t length, Buffer *out) {
+    uint64_t began = now_ns();
+    uint64_t lsn = 0;
+    int status = ST_SUCCESS;
+    size_t start = frame_begin(out);
+
+    if (opcode == OP_RESERVE || opcode == OP_CANCEL) {
+        if (length != 12) {
+            status = ST_INVALID;
+        } else {
+            int ref = get_u32(payload), agency_id = get_u32(payload + 4);
+            int value = get_u32(payload + 8);
+            status = opcode == OP_RESERVE ? reserve(ref, agency_id, value, &lsn)
+                                          : cancel(ref, agency_id, value, &lsn);
+        }
+    } else if (opcode == OP_RESERVE_BATCH) {
+        uint32_t legs = length >= 8 ? get_u32(payload + 4) : 0;
+        if (length < 8 || legs > MAX_BATCH_LEGS || length != 8 + 8 * legs) {
+            status = ST_INVALID;
+        } else {
+            int refs[MAX_BATCH_LEGS], values[MAX_BATCH_LEGS];
+            for (uint32_t i = 0; i < legs; i++) {
+                refs[i] = get_u32(payload + 8 + 8 * i);
+                values[i] = get_u32(payload + 12 + 8 * i);
+            }
+            status = reserve_batch(get_u32(payload), refs, values, legs, &lsn);
+        }
+    } else if (opcode == OP_HOLD) {
+        if (length != 16) {
+            status = ST_INVALID;
+        } else {
+            uint64_t hold_id;
+            status = hold_seats(get_u32(payload), get_u32(payload + 4), get_u32(payload + 8),
+                                get_u32(payload + 12), &hold_id);
+            if (status == ST_SUCCESS) buffer_put_u64(out, hold_id);
+        }
+    } else if (opcode == OP_CONFIRM || opcode == OP_RELEASE) {
+        if (length != 8) {
+            status = ST_INVALID;
+        } else {
+            status = opcode == OP_CONFIRM ? confirm_hold(get_u64(payload), &lsn)
+                                          : release_hold(get_u64(payload));
+        }
+    } else if (opcode == OP_INVOICE) {
+        if (length != 4) {
+            status = ST_INVALID;
+        } else {
+            Agency *agency = find_agency(get_u32(payload));
+            long long cents = agency ? __atomic_load_n(&agency->total_payments, __ATOMIC_RELAXED) : 0;
+            buffer_put_u32(out, (uint64_t)cents >> 32);
+            buffer_put_u32(out, (uint64_t)cents & 0xffffffff);
+        }
+    } else if (opcode == OP_CONSULT) {
+        Catalogue *cat = catalogue_acquire();
+        buffer_append(out, cat->binary.data, cat->binary.len);
+        catalogue_release(cat);
+    } else if (opcode == OP_CONSULT_SINCE) {
+        if (length != 8) {
+            status = ST_INVALID;
+        } else {
+            consult_since(get_u64(payload), out, 1);
+        }
+    } else if (opcode == OP_STATS) {
+        stats_report(out);
+    } else if (opcode == OP_SEARCH) {
+        SearchQuery query;
+        memset(&query, 0, sizeof(query));
+        if (length < 21 || length != 21u + payload[20] || payload[20] >= sizeof(query.destination) ||
+            get_u32(payload + 12) > SEARCH_BY_REF || (int)get_u32(payload + 16) < 0) {
+            status = ST_INVALID;
+        } else {
+            query.min_seats = get_u32(payload);
+            query.min_price = (int)get_u32(payload + 4);
+            query.max_price = (int)get_u32(payload + 8);
+            query.order = get_u32(payload + 12);
+            query.limit = get_u32(payload + 16);
+            memcpy(query.destination, payload + 21, payload[20]);
+            search_flights(&query, out, 1);
+        }
+    } else if (opcode == OP_HISTORY) {
+        if (length != 28) {
+            status = ST_INVALID;
+        } else {
+            history_command(get_u32(payload), (int64_t)get_u64(payload + 4),
+                            (int64_t)get_u64(payload + 12), get_u32(payload + 20),
+                            get_u32(payload + 24), out, 1);
+        }
+    } else if (opcode == OP_TEXT) {
+        char *command = malloc(length + 1);
+        if (!command) {
+            status = ST_SERVER_ERROR;
+        } else {
+            memcpy(command, payload, length);
+            command[length] = '\0';
+            lsn = process_request(command, out);
+            free(command);
+        }
+    } else {
+        status = ST_UNKNOWN;
+    }
 
-// Charge les vols depuis vols.txt
-void load_flights() {
-    FILE *fp = fopen("vols.txt", "r");
-    if (!fp) {
-        perror("Erreur lors de l'ouverture de vols.txt");
-        exit(EXIT_FAILURE);
+    frame_end(out, start, opcode, status, request_id);
+    if (opcode != OP_TEXT) stats_command(frame_command(opcode), began); // OP_TEXT: déjà compté
+    return lsn;
+}
+
+// Crée un abonnement aux vols refs (count == 0: tous). NULL si aucune des
+// références demandées n'existe.
+Subscriber *subscriber_create(const int *refs, int count, int binary) {
+    Subscriber *sub = calloc(1, sizeof(Subscriber));
+    if (!sub) return NULL;
+    sub->fd = -1;
+    sub->binary = binary;
+    sub->initial = 1;
+    if (count > 0) {
+        sub->flights = malloc(count * sizeof(int));
+        for (int i = 0; sub->flights && i < count; i++) {
+            int idx = find_flight_index(refs[i]);
+            if (idx != -1) sub->flights[sub->num_flights++] = idx;
+        }
+        if (sub->num_flights == 0) {
+            free(sub->flights);
+            free(sub);
+            return NULL;
+        }
     }
-    char line[256];
-    while (fgets(line, sizeof(line), fp) && num_flights < MAX_FLIGHTS) {
-        sscanf(line, "%d %s %d %d", 
-               &flights[num_flights].ref, 
-               flights[num_flights].destination, 
-               &flights[num_flights].available_seats, 
-               &flights[num_flights].price);
-        num_flights++;
+    return sub;
+}
+
+void subscriber_free(Subscriber *sub) {
+    if (sub->fd >= 0) close(sub->fd);
+    buffer_free(&sub->out);
+    free(sub->flights);
+    free(sub);
+}
+
+// SUBSCRIBE [ref...] en texte
+Subscriber *subscribe_text(const char *args) {
+    int refs[256], count = 0, n;
+    int ref;
+    while (count < 256 && sscanf(args, "%d%n", &ref, &n) == 1) {
+        refs[count++] = ref;
+        args += n;
     }
-    fclose(fp);
-    printf("Vols chargés: %d\n", num_flights);
+    return subscriber_create(refs, count, 0);
 }
 
-// Rejoue les transactions historiques depuis histo.txt
-void replay_history() {
-    FILE *fp = fopen("histo.txt", "r");
-    if (!fp) return; // Fichier peut ne pas exister au démarrage
-    char line[256];
-    while (fgets(line, sizeof(line), fp)) {
-        int ref, agency_id, value;
-        char transaction[20], result[20];
-        sscanf(line, "%d %d %s %d %s", &ref, &agency_id, transaction, &value, result);
-        
-        int flight_idx = -1;
-        for (int i = 0; i < num_flights; i++) {
-            if (flights[i].ref == ref) {
-                flight_idx = i;
-                break;
+// OP_SUBSCRIBE: nombre de références puis les références
+Subscriber *subscribe_frame(const unsigned char *payload, uint32_t length) {
+    if (length < 4) return NULL;
+    uint32_t count = get_u32(payload);
+    if (length != 4 + 4 * (uint64_t)count) return NULL;
+    int *refs = malloc((count + 1) * sizeof(int));
+    if (!refs) return NULL;
+    for (uint32_t i = 0; i < count; i++) refs[i] = get_u32(payload + 4 + 4 * i);
+    Subscriber *sub = subscriber_create(refs, count, 1);
+    free(refs);
+    return sub;
+}
+
+void subscriber_put(Subscriber *sub, int idx, uint64_t version) {
+    if (sub->binary) {
+        buffer_put_u32(&sub->out, flights[idx].ref);
+        buffer_put_u32(&sub->out, get_seats(&flights[idx]));
+    } else {
+        buffer_printf(&sub->out, "UPDATE %d %d %llu\n", flights[idx].ref,
+                      get_seats(&flights[idx]), (unsigned long long)version);
+    }
+}
+
+// Ajoute à la file de l'abonné les vols modifiés depuis sa dernière
+// notification, avec leurs places actuelles. Un abonné lent n'est servi que
+// lorsque sa file s'est vidée: il reçoit alors l'état courant des vols
+// modifiés entre-temps (coalescence), jamais plus d'une ligne par vol.
+void subscriber_update(Subscriber *sub, uint64_t *marks, uint64_t *stamp) {
+    uint64_t version = published_version();
+    if (version <= sub->version && !sub->initial) return;
+
+    size_t start = sub->out.len;
+    uint32_t count = 0;
+    if (sub->binary) {
+        start = frame_begin(&sub->out);
+        buffer_put_u64(&sub->out, version);
+        buffer_put_u32(&sub->out, 0);
+    }
+    size_t entries = sub->out.len;
+    int full_scan = !sub->flights;
+    if (sub->flights) {
+        for (int i = 0; i < sub->num_flights; i++) {
+            int idx = sub->flights[i];
+            if (sub->initial || __atomic_load_n(&flight_versions[idx], __ATOMIC_ACQUIRE) > sub->version) {
+                subscriber_put(sub, idx, version);
+                count++;
             }
         }
-        
-        if (flight_idx != -1) {
-            if (strcmp(transaction, "Demande") == 0 && strcmp(result, "succès") == 0) {
-                flights[flight_idx].available_seats -= value;
-                total_payments[agency_id] += value * flights[flight_idx].price;
-            } else if (strcmp(transaction, "Annulation") == 0) {
-                flights[flight_idx].available_seats += value;
-                total_payments[agency_id] -= 0.9 * value * flights[flight_idx].price;
+    } else if (!sub->initial && version - sub->version <= CHANGE_RING_SIZE / 2) {
+        // Seulement les vols des versions récentes, chacun une fois
+        (*stamp)++;
+        for (uint64_t v = sub->version + 1; v <= version; v++) {
+            int idx = __atomic_load_n(&change_ring[v & (CHANGE_RING_SIZE - 1)], __ATOMIC_RELAXED);
+            if (marks[idx] == *stamp) continue;
+            marks[idx] = *stamp;
+            subscriber_put(sub, idx, version);
+            count++;
+        }
+        // Des entrées ont pu être écrasées par des versions plus récentes
+        full_scan = __atomic_load_n(&next_version, __ATOMIC_ACQUIRE) - sub->version > CHANGE_RING_SIZE;
+        if (full_scan) {
+            sub->out.len = entries;
+            count = 0;
+        }
+    }
+    if (full_scan) {
+        for (int idx = 0; idx < num_flights; idx++) {
+            if (sub->initial || __atomic_load_n(&flight_versions[idx], __ATOMIC_ACQUIRE) > sub->version) {
+                subscriber_put(sub, idx, version);
+                count++;
             }
         }
     }
-    fclose(fp);
-}
+    sub->version = version;
+    sub->initial = 0;
 
-// Met à jour facture.txt avec les paiements totaux
-void update_facture() {
-    FILE *fp = fopen("facture.txt", "w");
-    if (!fp) {
-        perror("Erreur lors de l'ouverture de facture.txt");
+    if (!sub->binary) return;
+    if (count == 0) {
+        sub->out.len = start;
         return;
     }
-    for (int i = 1; i <= MAX_AGENCIES; i++) {
-        if (total_payments[i] != 0) {
-            fprintf(fp, "%d %.2f\n", i, total_payments[i]);
-        }
-    }
-    fclose(fp);
+    put_u32((unsigned char *)sub->out.data + start + FRAME_HEADER_SIZE + 8, count);
+    frame_end(&sub->out, start, OP_NOTIFY, ST_SUCCESS, 0);
 }
 
-// Met à jour vols.txt après chaque transaction
-void update_vols() {
-    FILE *fp = fopen("vols.txt", "w");
-    if (!fp) {
-        perror("Erreur lors de l'ouverture de vols.txt pour écriture");
-        return;
+// Envoie la file de l'abonné; -1 s'il s'est déconnecté
+int subscriber_flush(Subscriber *sub) {
+    while (sub->out.len > 0) {
+        ssize_t sent = send(sub->fd, sub->out.data, sub->out.len, MSG_NOSIGNAL);
+        if (sent > 0) {
+            buffer_consume(&sub->out, sent);
+        } else if (sent < 0 && errno == EINTR) {
+            continue;
+        } else if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else {
+            return -1;
+        }
     }
-    for (int i = 0; i < num_flights; i++) {
-        fprintf(fp, "%d %s %d %d\n", flights[i].ref, flights[i].destination, 
-                flights[i].available_seats, flights[i].price);
+    int writing = sub->out.len > 0;
+    if (writing != sub->writing) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP | (writing ? EPOLLOUT : 0);
+        ev.data.ptr = sub;
+        epoll_ctl(notify_epoll, EPOLL_CTL_MOD, sub->fd, &ev);
+        sub->writing = writing;
     }
-    fclose(fp);
+    return 0;
 }
 
-// Trouve l'index d'un vol par sa référence
-int find_flight_index(int ref) {
-    for (int i = 0; i < num_flights; i++) {
-        if (flights[i].ref == ref) {
-            return i;
-        }
+// Confie une connexion qui vient de s'abonner au thread de notification
+// (elle a déjà quitté l'epoll des workers)
+void subscriber_adopt(Connection *conn) {
+    Subscriber *sub = conn->subscriber;
+    sub->fd = conn->fd;
+    buffer_append(&sub->out, conn->out.data, conn->out.len); // Reste de la réponse
+    buffer_free(&conn->in);
+    buffer_free(&conn->out);
+    buffer_free(&conn->sending);
+    free(conn);
+
+    pthread_mutex_lock(&subscribers_mutex);
+    sub->next = new_subscribers;
+    new_subscribers = sub;
+    pthread_mutex_unlock(&subscribers_mutex);
+    __atomic_add_fetch(&num_subscribers, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&notify_pending, 1, __ATOMIC_RELEASE);
+    uint64_t one = 1;
+    if (write(notify_fd, &one, sizeof(one)) < 0) {
+        perror("Erreur lors du réveil du thread de notification");
     }
-    return -1;
 }
 
-// Traite les requêtes des clients TCP dans un thread séparé
-void* handle_client(void* arg) {
-    int client_sock = *(int*)arg;
-    free(arg);
-    char buffer[256];
+// Thread de notification: pousse les changements de places aux abonnés
+void* notification_thread(void* arg) {
+    Subscriber *subscribers = NULL;
+    uint64_t *marks = calloc(num_flights + 1, sizeof(uint64_t));
+    uint64_t stamp = 0;
+    struct epoll_event events[MAX_EVENTS];
+    if (!marks) {
+        perror("Erreur d'allocation des notifications");
+        exit(EXIT_FAILURE);
+    }
 
     while (1) {
-        int bytes = recv(client_sock, buffer, sizeof(buffer) - 1, 0);
-        if (bytes <= 0) break;
-        buffer[bytes] = '\0';
-
-        pthread_mutex_lock(&mutex);
+        int n = epoll_wait(notify_epoll, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("Erreur lors de epoll_wait (notifications)");
+            exit(EXIT_FAILURE);
+        }
+        int changed = 0;
+        for (int i = 0; i < n; i++) {
+            Subscriber *sub = events[i].data.ptr;
+            if (sub == NULL) {
+                uint64_t count;
+                if (read(notify_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+                    perror("Erreur de lecture de l'eventfd");
+                }
+                changed = 1;
+                continue;
+            }
+            // Un abonné n'envoie plus rien: toute donnée reçue est ignorée
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                char discard[256];
+                ssize_t bytes = recv(sub->fd, discard, sizeof(discard), 0);
+                if (bytes == 0 || (bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+                    sub->closed = 1;
+                }
+            }
+        }
+        // Les changements publiés après ce point redemanderont un réveil
+        __atomic_store_n(&notify_pending, 0, __ATOMIC_SEQ_CST);
 
-        char command[20];
-        sscanf(buffer, "%s", command);
+        pthread_mutex_lock(&subscribers_mutex);
+        while (new_subscribers) {
+            Subscriber *sub = new_subscribers;
+            new_subscribers = sub->next;
+            sub->next = subscribers;
+            subscribers = sub;
+            struct epoll_event ev;
+            ev.events = EPOLLIN | EPOLLRDHUP;
+            ev.data.ptr = sub;
+            epoll_ctl(notify_epoll, EPOLL_CTL_ADD, sub->fd, &ev);
+        }
+        pthread_mutex_unlock(&subscribers_mutex);
 
-        if (strcmp(command, "RESERVE") == 0 || strcmp(command, "CANCEL") == 0) {
-            int ref, agency_id, value;
-            int parsed = sscanf(buffer + strlen(command), "%d %d %d", &ref, &agency_id, &value);
-            if (parsed != 3) {
-                send(client_sock, "INVALID_COMMAND", 15, 0);
-                pthread_mutex_unlock(&mutex);
+        for (Subscriber **link = &subscribers; *link;) {
+            Subscriber *sub = *link;
+            if (changed) sub->stale = 1;
+            if (!sub->closed && sub->out.len >= SUBSCRIBER_HIGH_WATER && subscriber_flush(sub) < 0) {
+                sub->closed = 1;
+            }
+            // Un abonné dont la file est pleine est sauté: les réservations
+            // ne l'attendent jamais, il recevra l'état courant plus tard
+            if (!sub->closed && sub->out.len < SUBSCRIBER_HIGH_WATER && (sub->stale || sub->initial)) {
+                subscriber_update(sub, marks, &stamp);
+                sub->stale = 0;
+            }
+            if (sub->closed || subscriber_flush(sub) < 0) {
+                epoll_ctl(notify_epoll, EPOLL_CTL_DEL, sub->fd, NULL);
+                *link = sub->next;
+                subscriber_free(sub);
+                __atomic_sub_fetch(&num_subscribers, 1, __ATOMIC_RELAXED);
                 continue;
             }
+            link = &sub->next;
+        }
+    }
+    return NULL;
+}
+
+// Prépare l'eventfd et l'epoll du thread de notification, puis le démarre
+void start_notifier() {
+    notify_fd = eventfd(0, EFD_NONBLOCK);
+    notify_epoll = epoll_create1(0);
+    if (notify_fd < 0 || notify_epoll < 0) {
+        perror("Erreur lors de la création de l'eventfd de notification");
+        exit(EXIT_FAILURE);
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL; // NULL identifie l'eventfd
+    if (epoll_ctl(notify_epoll, EPOLL_CTL_ADD, notify_fd, &ev) < 0) {
+        perror("Erreur lors de l'ajout de l'eventfd à epoll");
+        exit(EXIT_FAILURE);
+    }
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, notification_thread, NULL) != 0) {
+        perror("Erreur lors de la création du thread de notification");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+}
+
+// Traite tout ce qui est complet dans le tampon d'entrée d'une connexion:
+// trames binaires (premier octet FRAME_MAGIC) ou commandes texte terminées
+// par '\n'. Les anciens clients envoient une commande par send() sans fin de
+// ligne: quand le socket est vidé (drained), le reste est pris tel quel.
+void process_input(Connection *conn, int drained) {
+    size_t pos = 0;
+    while (pos < conn->in.len && !conn->closed && !conn->subscriber &&
+           conn->out.len < OUT_HIGH_WATER) {
+        unsigned char *p = (unsigned char *)conn->in.data + pos;
+        size_t avail = conn->in.len - pos;
+        uint64_t lsn;
 
-            FILE *histo_fp = fopen("histo.txt", "a");
-            if (!histo_fp) {
-                send(client_sock, "SERVER_ERROR", 12, 0);
-                pthread_mutex_unlock(&mutex);
+        if (p[0] == FRAME_MAGIC) {
+            int opcode, status;
+            uint32_t request_id, length;
+            if (avail < FRAME_HEADER_SIZE) break;
+            decode_frame_header(p, &opcode, &status, &request_id, &length);
+            if (length > MAX_FRAME_PAYLOAD) {
+                conn->closed = 1; // Flux désynchronisé
+                break;
+            }
+            if (avail < FRAME_HEADER_SIZE + length) break;
+            pos += FRAME_HEADER_SIZE + length;
+            if (opcode == OP_SUBSCRIBE) {
+                conn->subscriber = subscribe_frame(p + FRAME_HEADER_SIZE, length);
+                size_t start = frame_begin(&conn->out);
+                frame_end(&conn->out, start, opcode, conn->subscriber ? ST_SUCCESS : ST_FAILURE,
+                          request_id);
                 continue;
             }
-
-            int flight_idx = find_flight_index(ref);
-            if (strcmp(command, "RESERVE") == 0) {
-                if (flight_idx != -1 && flights[flight_idx].available_seats >= value) {
-                    flights[flight_idx].available_seats -= value;
-                    total_payments[agency_id] += value * flights[flight_idx].price;
-                    fprintf(histo_fp, "%d %d Demande %d succès\n", ref, agency_id, value);
-                    send(client_sock, "SUCCESS", 7, 0);
-                    update_vols();
-                } else {
-                    fprintf(histo_fp, "%d %d Demande %d impossible\n", ref, agency_id, value);
-                    send(client_sock, "FAILURE", 7, 0);
-                }
-            } else { // CANCEL
-                if (flight_idx != -1) {
-                    flights[flight_idx].available_seats += value;
-                    total_payments[agency_id] -= 0.9 * value * flights[flight_idx].price;
-                    fprintf(histo_fp, "%d %d Annulation %d succès\n", ref, agency_id, value);
-                    send(client_sock, "SUCCESS", 7, 0);
-                    update_vols();
-                } else {
-                    send(client_sock, "FAILURE", 7, 0);
-                }
+            lsn = process_frame(opcode, request_id, p + FRAME_HEADER_SIZE, length, &conn->out);
+        } else {
+            char *line = (char *)p;
+            char *nl = memchr(line, '\n', avail);
+            if (nl) {
+                *nl = '\0';
+                pos += nl - line + 1;
+            } else if (drained) {
+                line[avail] = '\0'; // Le tampon garde toujours un octet libre
+                pos += avail;
+            } else {
+                break;
             }
-            fclose(histo_fp);
-        } else if (strcmp(command, "INVOICE") == 0) {
-            int agency_id;
-            int parsed = sscanf(buffer + strlen(command), "%d", &agency_id);
-            if (parsed != 1) {
-                send(client_sock, "INVALID_COMMAND", 15, 0);
-                pthread_mutex_unlock(&mutex);
+            if (line[strspn(line, " \t\r")] == '\0') continue; // Ligne vide
+            if (strncmp(line, "SUBSCRIBE", 9) == 0 && (line[9] == '\0' || isspace((unsigned char)line[9]))) {
+                conn->subscriber = subscribe_text(line + 9);
+                buffer_printf(&conn->out, "%s", conn->subscriber ? "SUBSCRIBED\n" : "FAILURE");
                 continue;
             }
-            char response[50];
-            snprintf(response, sizeof(response), "INVOICE %.2f", total_payments[agency_id]);
-            send(client_sock, response, strlen(response), 0);
-        } else if (strcmp(command, "CONSULT") == 0) {
-            char response[8192] = "";
-            for (int i = 0; i < num_flights; i++) {
-                char flight_info[256];
-                snprintf(flight_info, sizeof(flight_info), "%d %s %d %d\n",
-                         flights[i].ref, flights[i].destination,
-                         flights[i].available_seats, flights[i].price);
-                strcat(response, flight_info);
-            }
-            send(client_sock, response, strlen(response), 0);
+            lsn = process_request(line, &conn->out);
+        }
+        if (lsn > conn->lsn) conn->lsn = lsn;
+    }
+    buffer_consume(&conn->in, conn->subscriber ? conn->in.len : pos);
+}
+
+// Passe un descripteur en mode non bloquant
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// Réarme une connexion dans epoll (EPOLLONESHOT: un seul thread à la fois)
+void rearm_connection(Connection *conn) {
+    struct epoll_event ev;
+    ev.events = EPOLLET | EPOLLONESHOT | EPOLLRDHUP;
+    if (conn->out.len < OUT_HIGH_WATER) ev.events |= EPOLLIN;
+    // EPOLLOUT se déclenche aussitôt sur un socket inscriptible: c'est ainsi
+    // qu'une connexion qui a cédé la main est reprise
+    if (conn->out.len > 0 || conn->yielded) ev.events |= EPOLLOUT;
+    ev.data.ptr = conn;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) < 0) {
+        perror("Erreur lors du réarmement epoll");
+    }
+}
+
+void close_connection(Connection *conn) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    buffer_free(&conn->in);
+    buffer_free(&conn->out);
+    free(conn);
+}
+
+// Envoie le plus possible du tampon de sortie; -1 si la connexion est perdue
+int flush_connection(Connection *conn) {
+    while (conn->out.len > 0) {
+        ssize_t sent = send(conn->fd, conn->out.data, conn->out.len, MSG_NOSIGNAL);
+        if (sent > 0) {
+            buffer_consume(&conn->out, sent);
+        } else if (sent < 0 && errno == EINTR) {
+            continue;
+        } else if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
         } else {
-            send(client_sock, "UNKNOWN_COMMAND", 15, 0);
+            return -1;
         }
+    }
+    return 0;
+}
 
-        update_facture();
-        pthread_mutex_unlock(&mutex);
+// Lit et exécute les commandes reçues sur une connexion agence
+void handle_client(Connection *conn, uint32_t events) {
+    if (events & EPOLLERR) conn->closed = 1;
+
+    // On vide le socket jusqu'à EAGAIN (mode edge-triggered), avec une
+    // limite pour ne pas monopoliser un thread du pool. Une lecture peut
+    // contenir plusieurs requêtes (pipelining), ou seulement un morceau.
+    int drained = 0;
+    for (int reads = 0; !drained && !conn->closed && reads < MAX_READS_PER_EVENT &&
+                        conn->in.len < IN_HIGH_WATER && conn->out.len < OUT_HIGH_WATER; reads++) {
+        buffer_reserve(&conn->in, 4096);
+        ssize_t bytes = recv(conn->fd, conn->in.data + conn->in.len,
+                             conn->in.cap - conn->in.len - 1, 0);
+        if (bytes > 0) {
+            conn->in.len += bytes;
+        } else if (bytes == 0) {
+            conn->closed = 1;
+        } else if (errno != EINTR) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) conn->closed = 1;
+            drained = 1;
+        }
     }
+    if (conn->in.len > 0) process_input(conn, drained || conn->closed);
+    // Tout ce qui est complet a été traité: un tampon encore plein ne peut
+    // être qu'une ligne sans fin ou une trame invalide
+    if (conn->in.len >= IN_HIGH_WATER && conn->out.len < OUT_HIGH_WATER) conn->closed = 1;
+    conn->yielded = !drained && !conn->closed && conn->out.len < OUT_HIGH_WATER;
+}
 
-    close(client_sock);
-    return NULL;
+// Envoie les réponses puis rend la connexion à epoll (ou la ferme)
+void finish_connection(Connection *conn) {
+    conn->lsn = 0;
+    // Même si le client a fermé son côté écriture, les réponses à ses
+    // dernières requêtes pipelinées lui sont encore envoyées
+    if (flush_connection(conn) < 0) conn->closed = 1;
+
+    if (conn->closed) {
+        if (conn->subscriber) subscriber_free(conn->subscriber);
+        close_connection(conn);
+    } else if (conn->subscriber) {
+        // La connexion ne sert plus qu'aux notifications: elle quitte l'epoll
+        // des workers pour celui du thread de notification
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+        subscriber_adopt(conn);
+    } else {
+        rearm_connection(conn);
+    }
+}
+
+// Accepte toutes les connexions en attente sur le socket d'écoute
+void accept_connections() {
+    while (1) {
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        int client_sock = accept(listen_sock, (struct sockaddr*)&client_addr, &client_len);
+        if (client_sock < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("Erreur lors de l'acceptation");
+            }
+            break;
+        }
+        if (set_nonblocking(client_sock) < 0) {
+            perror("Erreur lors du passage en mode non bloquant");
+            close(client_sock);
+            continue;
+        }
+
+        Connection *conn = calloc(1, sizeof(Connection));
+        if (!conn) {
+            perror("Erreur d'allocation de la connexion");
+            close(client_sock);
+            continue;
+        }
+        conn->fd = client_sock;
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLET | EPOLLONESHOT | EPOLLRDHUP;
+        ev.data.ptr = conn;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_sock, &ev) < 0) {
+            perror("Erreur lors de l'ajout à epoll");
+            close(client_sock);
+            free(conn);
+        }
+    }
+
+    // Le socket d'écoute est lui aussi en EPOLLONESHOT
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
+    ev.data.ptr = NULL;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, listen_sock, &ev);
 }
 
-// Traite les requêtes UDP des agences
-void handle_agency_udp(int agency_sock) {
-    char buffer[256];
-    struct sockaddr_in client_addr;
-    socklen_t client_len = sizeof(client_addr);
+// Boucle d'un thread du pool: attend les événements et les traite
+void* tcp_worker(void* arg) {
+    struct epoll_event events[MAX_EVENTS];
+    Connection *ready[MAX_EVENTS];
+    // Les réponses aux RESERVE/CANCEL ne partent qu'une fois leurs lignes
+    // durables. Le worker ne les attend pas: la connexion (désarmée par
+    // EPOLLONESHOT) est mise de côté et les autres sont servies pendant ce
+    // temps. Tant qu'il y en a, il attend à la fois l'epoll partagé et son
+    // event_fd, réunis dans un epoll qui lui est propre.
+    Parked parked;
+    parked_init(&parked, EFD_NONBLOCK);
+    int own_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    if (own_fd < 0 || epoll_ctl(own_fd, EPOLL_CTL_ADD, epoll_fd, &ev) < 0) {
+        perror("Erreur lors de la création de l'epoll du worker");
+        exit(EXIT_FAILURE);
+    }
+    ev.data.ptr = &parked;
+    if (epoll_ctl(own_fd, EPOLL_CTL_ADD, parked.event_fd, &ev) < 0) {
+        perror("Erreur lors de l'ajout de l'eventfd à epoll");
+        exit(EXIT_FAILURE);
+    }
     while (1) {
-        int bytes = recvfrom(agency_sock, buffer, sizeof(buffer) - 1, 0, 
-                            (struct sockaddr*)&client_addr, &client_len);
-        if (bytes <= 0) continue;
-        buffer[bytes] = '\0';
-
-        pthread_mutex_lock(&mutex);
-
-        char command[20];
-        sscanf(buffer, "%s", command);
-
-        if (strcmp(command, "RESERVE") == 0 || strcmp(command, "CANCEL") == 0) {
-            int ref, agency_id, value;
-            int parsed = sscanf(buffer + strlen(command), "%d %d %d", &ref, &agency_id, &value);
-            if (parsed != 3) {
-                sendto(agency_sock, "INVALID_COMMAND", 15, 0, 
-                       (struct sockaddr*)&client_addr, client_len);
-                pthread_mutex_unlock(&mutex);
+        int n;
+        if (parked.count == 0) {
+            n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        } else {
+            struct epoll_event wake[2];
+            n = epoll_wait(own_fd, wake, 2, -1);
+            int shared = 0;
+            for (int i = 0; i < n; i++) {
+                if (wake[i].data.ptr == NULL) {
+                    shared = 1;
+                } else {
+                    uint64_t count;
+                    if (read(parked.event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+                        perror("Erreur lors de la lecture de l'eventfd du worker");
+                    }
+                }
+            }
+            // Un autre worker a pu prendre les événements entre-temps
+            if (n > 0) n = shared ? epoll_wait(epoll_fd, events, MAX_EVENTS, 0) : 0;
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("Erreur lors de epoll_wait");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < n; i++) {
+            Connection *conn = events[i].data.ptr;
+            if (conn == NULL) {
+                accept_connections();
                 continue;
             }
+            handle_client(conn, events[i].events);
+            if (conn->lsn > __atomic_load_n(&journal.acked_lsn, __ATOMIC_ACQUIRE) &&
+                conn->out.len > 0) {
+                parked_add(&parked, conn);
+            } else {
+                finish_connection(conn);
+            }
+        }
+        int num_ready;
+        do {
+            num_ready = parked_release(&parked, ready, MAX_EVENTS);
+            for (int i = 0; i < num_ready; i++) {
+                finish_connection(ready[i]);
+            }
+        } while (num_ready == MAX_EVENTS);
+    }
+    return NULL;
+}
+
+// Mode io_uring (-u): chaque worker possède un anneau et y garde une
+// acceptation en cours sur le socket d'écoute partagé, plus une réception
+// par connexion. Les complétions sont traitées par lots; les envois et les
+// nouvelles réceptions partent ensemble au prochain ring_enter(). Une
+// connexion dont la réponse attend le journal est mise de côté jusqu'à la
+// complétion de la lecture de l'event_fd du worker. Les sockets restent
+// bloquants: c'est le noyau qui attend qu'ils soient prêts.
+void uring_post_accept(Ring *ring) {
+    struct io_uring_sqe *sqe = ring_sqe(ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_sock;
+    sqe->user_data = URING_ACCEPT;
+}
+
+// Lecture de l'event_fd: se termine quand journal_writer réveille le worker
+void uring_post_wake(Ring *ring, Parked *parked, uint64_t *count) {
+    struct io_uring_sqe *sqe = ring_sqe(ring);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = parked->event_fd;
+    sqe->addr = (uintptr_t)count;
+    sqe->len = sizeof(*count);
+    sqe->user_data = URING_WAKE;
+}
+
+void uring_post_recv(Ring *ring, Connection *conn) {
+    buffer_reserve(&conn->in, 4096);
+    conn->recv_size = conn->in.cap - conn->in.len - 1;
+    struct io_uring_sqe *sqe = ring_sqe(ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->addr = (uintptr_t)(conn->in.data + conn->in.len);
+    sqe->len = conn->recv_size;
+    sqe->user_data = (uintptr_t)conn | URING_RECV;
+    conn->recv_pending = 1;
+}
+
+// Envoie sending, ou à défaut out (échangés: out reste libre de grandir)
+void uring_post_send(Ring *ring, Connection *conn) {
+    if (conn->sending.len == 0) {
+        Buffer tmp = conn->sending;
+        conn->sending = conn->out;
+        conn->out = tmp;
+    }
+    struct io_uring_sqe *sqe = ring_sqe(ring);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->fd;
+    sqe->addr = (uintptr_t)conn->sending.data;
+    sqe->len = conn->sending.len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uintptr_t)conn | URING_SEND;
+    conn->send_pending = 1;
+}
+
+// Après un lot de complétions (réponses durables): envoie les
+// réponses, relance la réception, ou libère la connexion une fois qu'aucune
+// opération ne la référence plus
+void uring_continue(Ring *ring, Connection *conn) {
+    conn->queued = 0;
+    conn->lsn = 0;
+    // Même si le client a fermé son côté écriture, les réponses à ses
+    // dernières requêtes pipelinées lui sont encore envoyées
+    if (!conn->send_pending && (conn->sending.len > 0 || conn->out.len > 0)) {
+        uring_post_send(ring, conn);
+    }
+    if (conn->closed) {
+        if (conn->recv_pending) {
+            // La réception en cours se termine (0 octet) au shutdown
+            if (!conn->shut) shutdown(conn->fd, SHUT_RD);
+            conn->shut = 1;
+            return;
+        }
+        if (conn->send_pending) return;
+        if (conn->subscriber) subscriber_free(conn->subscriber);
+        close(conn->fd);
+        buffer_free(&conn->in);
+        buffer_free(&conn->out);
+        buffer_free(&conn->sending);
+        free(conn);
+    } else if (conn->subscriber) {
+        // Confiée au thread de notification une fois les envois terminés
+        if (conn->send_pending) return;
+        if (set_nonblocking(conn->fd) < 0) {
+            perror("Erreur lors du passage en mode non bloquant");
+        }
+        subscriber_adopt(conn);
+    } else if (!conn->recv_pending && conn->out.len < OUT_HIGH_WATER) {
+        uring_post_recv(ring, conn);
+    }
+}
 
-            FILE *histo_fp = fopen("histo.txt", "a");
-            if (!histo_fp) {
-                sendto(agency_sock, "SERVER_ERROR", 12, 0, 
-                       (struct sockaddr*)&client_addr, client_len);
-                pthread_mutex_unlock(&mutex);
+// Boucle d'un thread du pool en mode io_uring
+void* uring_worker(void* arg) {
+    Ring ring;
+    if (ring_init(&ring, URING_ENTRIES) < 0) {
+        perror("Erreur lors de la création de l'anneau io_uring");
+        exit(EXIT_FAILURE);
+    }
+    uring_post_accept(&ring);
+    Parked parked;
+    uint64_t wake_count;
+    parked_init(&parked, 0);
+    uring_post_wake(&ring, &parked, &wake_count);
+    Connection *touched[URING_BATCH];
+    Connection *ready[URING_BATCH];
+    while (1) {
+        if (ring_enter(&ring, 1) < 0 && errno != EINTR && errno != EBUSY) {
+            perror("Erreur lors de io_uring_enter");
+            exit(EXIT_FAILURE);
+        }
+        int num_touched = 0;
+        struct io_uring_cqe *cqe;
+        while (num_touched < URING_BATCH && (cqe = ring_peek(&ring))) {
+            uint64_t data = cqe->user_data;
+            int res = cqe->res;
+            ring_seen(&ring);
+            Connection *conn = (Connection *)(uintptr_t)(data & ~(uint64_t)3);
+
+            if ((data & 3) == URING_WAKE) {
+                uring_post_wake(&ring, &parked, &wake_count);
                 continue;
+            } else if ((data & 3) == URING_ACCEPT) {
+                uring_post_accept(&ring);
+                if (res < 0) {
+                    if (res != -EINTR && res != -ECONNABORTED) {
+                        errno = -res;
+                        perror("Erreur lors de l'acceptation");
+                    }
+                    continue;
+                }
+                conn = calloc(1, sizeof(Connection));
+                if (!conn) {
+                    perror("Erreur d'allocation de la connexion");
+                    close(res);
+                    continue;
+                }
+                conn->fd = res;
+            } else if ((data & 3) == URING_RECV) {
+                conn->recv_pending = 0;
+                if (res > 0) {
+                    conn->in.len += res;
+                    // Réception plus courte que la place offerte: le socket
+                    // est vidé, comme l'EAGAIN du mode epoll
+                    process_input(conn, res < conn->recv_size);
+                    if (conn->in.len >= IN_HIGH_WATER && conn->out.len < OUT_HIGH_WATER) {
+                        conn->closed = 1;
+                    }
+                } else if (res != -EINTR && res != -EAGAIN) {
+                    conn->closed = 1;
+                }
+            } else {
+                conn->send_pending = 0;
+                if (res > 0) {
+                    buffer_consume(&conn->sending, res);
+                } else if (res != -EINTR && res != -EAGAIN) {
+                    conn->closed = 1;
+                    conn->sending.len = conn->out.len = 0; // Client perdu
+                }
+                // Place libérée: reprend les requêtes laissées en attente
+                if (!conn->recv_pending && conn->in.len > 0) process_input(conn, 0);
+            }
+            // Une connexion déjà mise de côté reste queued: elle y attend
+            // sa nouvelle position
+            if (!conn->queued) {
+                conn->queued = 1;
+                touched[num_touched++] = conn;
+            }
+        }
+        // Les réponses aux RESERVE/CANCEL ne partent qu'une fois leurs lignes
+        // durables; les autres connexions n'attendent pas
+        uint64_t acked = __atomic_load_n(&journal.acked_lsn, __ATOMIC_ACQUIRE);
+        for (int i = 0; i < num_touched; i++) {
+            Connection *conn = touched[i];
+            if (conn->lsn > acked) {
+                parked_add(&parked, conn);
+            } else {
+                uring_continue(&ring, conn);
+            }
+        }
+        int num_ready;
+        do {
+            num_ready = parked_release(&parked, ready, URING_BATCH);
+            for (int i = 0; i < num_ready; i++) {
+                uring_continue(&ring, ready[i]);
             }
+        } while (num_ready == URING_BATCH);
+    }
+    return NULL;
+}
 
-            int flight_idx = find_flight_index(ref);
-            if (strcmp(command, "RESERVE") == 0) {
-                if (flight_idx != -1 && flights[flight_idx].available_seats >= value) {
-                    flights[flight_idx].available_seats -= value;
-                    total_payments[agency_id] += value * flights[flight_idx].price;
-                    fprintf(histo_fp, "%d %d Demande %d succès\n", ref, agency_id, value);
-                    sendto(agency_sock, "SUCCESS", 7, 0, 
-                           (struct sockaddr*)&client_addr, client_len);
-                    update_vols();
-                } else {
-                    fprintf(histo_fp, "%d %d Demande %d impossible\n", ref, agency_id, value);
-                    sendto(agency_sock, "FAILURE", 7, 0, 
-                           (struct sockaddr*)&client_addr, client_len);
+// Ouvre un socket UDP sur le port des agences. Chaque worker a le sien:
+// avec SO_REUSEPORT, le noyau répartit les datagrammes entre eux (toujours
+// le même socket pour un même client, donc ses requêtes restent ordonnées).
+int open_udp_socket(struct sockaddr_in *server_addr) {
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0) {
+        perror("Erreur lors de la création du socket UDP");
+        exit(EXIT_FAILURE);
+    }
+    int opt = 1;
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        perror("Erreur lors de l'activation de SO_REUSEPORT");
+        exit(EXIT_FAILURE);
+    }
+    if (bind(sock, (struct sockaddr*)server_addr, sizeof(*server_addr)) < 0) {
+        perror("Erreur lors du bind UDP");
+        exit(EXIT_FAILURE);
+    }
+    return sock;
+}
+
+// Réponse déjà envoyée à une requête UDP identifiée "#agence:numéro"
+typedef struct {
+    int agency_id;
+    uint32_t request_id;
+    uint64_t stamp;   // Ordre d'insertion (0: libre); la plus ancienne est remplacée
+    int length;
+    char reply[UDP_DEDUP_REPLY_MAX];
+} UdpReply;
+
+// Cherche la réponse à (agency_id, request_id). Renvoie l'entrée et *found
+// si elle y est, sinon l'entrée à réutiliser (la plus ancienne du seau).
+UdpReply *udp_dedup_lookup(UdpReply *cache, int agency_id, uint32_t request_id, int *found) {
+    size_t bucket = hash_int(agency_id ^ (int)(request_id * 2654435761u)) & (UDP_DEDUP_BUCKETS - 1);
+    UdpReply *ways = &cache[bucket * UDP_DEDUP_WAYS], *oldest = ways;
+    for (int i = 0; i < UDP_DEDUP_WAYS; i++) {
+        if (ways[i].stamp && ways[i].agency_id == agency_id && ways[i].request_id == request_id) {
+            *found = 1;
+            return &ways[i];
+        }
+        if (ways[i].stamp < oldest->stamp) oldest = &ways[i];
+    }
+    *found = 0;
+    return oldest;
+}
+
+// Traite les requêtes UDP des agences par lots: un recvmmsg récupère tous
+// les datagrammes en attente (jusqu'à UDP_BATCH), le journal est attendu une
+// seule fois pour le lot, puis un sendmmsg renvoie toutes les réponses.
+// Une requête préfixée "#agence:numéro " reçoit une réponse au même préfixe,
+// gardée dans un cache borné: une retransmission (réponse perdue) reçoit la
+// même réponse sans être exécutée deux fois. SO_REUSEPORT envoyant un client
+// toujours au même worker, chaque worker a son propre cache, sans verrou.
+// Une réponse rejouée est déjà durable: elle n'est gardée qu'après
+// l'attente du journal de son lot, ou fait partie du même lot.
+void* udp_worker(void* arg) {
+    int agency_sock = open_udp_socket(arg);
+    char requests[UDP_BATCH][UDP_REQUEST_MAX];
+    Buffer responses[UDP_BATCH] = {{0}};
+    struct sockaddr_in client_addrs[UDP_BATCH];
+    struct iovec iovecs[UDP_BATCH];
+    struct mmsghdr msgs[UDP_BATCH];
+    UdpReply *cache = calloc(UDP_DEDUP_BUCKETS * UDP_DEDUP_WAYS, sizeof(UdpReply));
+    if (!cache) {
+        perror("Erreur d'allocation du cache UDP");
+        exit(EXIT_FAILURE);
+    }
+    uint64_t stamp = 0;
+
+    while (1) {
+        memset(msgs, 0, sizeof(msgs));
+        for (int i = 0; i < UDP_BATCH; i++) {
+            iovecs[i].iov_base = requests[i];
+            iovecs[i].iov_len = UDP_REQUEST_MAX - 1;
+            msgs[i].msg_hdr.msg_iov = &iovecs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &client_addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(client_addrs[i]);
+        }
+        // MSG_WAITFORONE: bloque jusqu'au premier datagramme, puis prend
+        // seulement ceux déjà arrivés
+        int n = recvmmsg(agency_sock, msgs, UDP_BATCH, MSG_WAITFORONE, NULL);
+        if (n <= 0) continue;
+
+        uint64_t wait_lsn = 0;
+        for (int i = 0; i < n; i++) {
+            requests[i][msgs[i].msg_len] = '\0';
+            responses[i].len = 0;
+            int agency_id, used = 0, found = 0;
+            unsigned int request_id;
+            UdpReply *entry = NULL;
+            if (requests[i][0] == '#' &&
+                sscanf(requests[i], "#%d:%u %n", &agency_id, &request_id, &used) == 2 && used > 0) {
+                buffer_printf(&responses[i], "#%d:%u ", agency_id, request_id);
+                entry = udp_dedup_lookup(cache, agency_id, request_id, &found);
+            }
+            if (found) {
+                buffer_append(&responses[i], entry->reply, entry->length);
+                thread_stats()->udp_replays++;
+            } else {
+                size_t start = responses[i].len;
+                uint64_t lsn = process_request(requests[i] + used, &responses[i]);
+                if (lsn > wait_lsn) wait_lsn = lsn;
+                if (responses[i].len > UDP_REPLY_MAX) {
+                    // CONSULT d'un grand catalogue...: le client doit passer par TCP
+                    fprintf(stderr, "Réponse UDP de %zu octets trop grande pour un datagramme,"
+                            " SERVER_ERROR envoyé\n", responses[i].len);
+                    responses[i].len = start;
+                    buffer_append(&responses[i], "SERVER_ERROR", 12);
                 }
-            } else { // CANCEL
-                if (flight_idx != -1) {
-                    flights[flight_idx].available_seats += value;
-                    total_payments[agency_id] -= 0.9 * value * flights[flight_idx].price;
-                    fprintf(histo_fp, "%d %d Annulation %d succès\n", ref, agency_id, value);
-                    sendto(agency_sock, "SUCCESS", 7, 0, 
-                           (struct sockaddr*)&client_addr, client_len);
-                    update_vols();
-                } else {
-                    sendto(agency_sock, "FAILURE", 7, 0, 
-                           (struct sockaddr*)&client_addr, client_len);
+                size_t length = responses[i].len - start;
+                if (entry && length <= UDP_DEDUP_REPLY_MAX) {
+                    entry->agency_id = agency_id;
+                    entry->request_id = request_id;
+                    entry->stamp = ++stamp;
+                    entry->length = length;
+                    memcpy(entry->reply, responses[i].data + start, length);
                 }
             }
-            fclose(histo_fp);
-        } else if (strcmp(command, "INVOICE") == 0) {
-            int agency_id;
-            int parsed = sscanf(buffer + strlen(command), "%d", &agency_id);
-            if (parsed != 1) {
-                sendto(agency_sock, "INVALID_COMMAND", 15, 0, 
-                       (struct sockaddr*)&client_addr, client_len);
-                pthread_mutex_unlock(&mutex);
-                continue;
+            iovecs[i].iov_base = responses[i].data;
+            iovecs[i].iov_len = responses[i].len;
+        }
+        journal_wait(wait_lsn);
+
+        int sent = 0;
+        while (sent < n) {
+            int r = sendmmsg(agency_sock, msgs + sent, n - sent, 0);
+            if (r > 0) {
+                sent += r;
+            } else if (r < 0 && errno != EINTR) {
+                perror("Erreur lors de l'envoi d'une réponse UDP");
+                sent++; // Réponse perdue: le client réessaiera
             }
-            char response[50];
-            snprintf(response, sizeof(response), "INVOICE %.2f", total_payments[agency_id]);
-            sendto(agency_sock, response, strlen(response), 0, 
-                   (struct sockaddr*)&client_addr, client_len);
-        } else if (strcmp(command, "CONSULT") == 0) {
-            char response[8192] = "";
-            for (int i = 0; i < num_flights; i++) {
-                char flight_info[256];
-                snprintf(flight_info, sizeof(flight_info), "%d %s %d %d\n",
-                         flights[i].ref, flights[i].destination,
-                         flights[i].available_seats, flights[i].price);
-                strcat(response, flight_info);
-            }
-            sendto(agency_sock, response, strlen(response), 0, 
-                   (struct sockaddr*)&client_addr, client_len);
-        } else {
-            sendto(agency_sock, "UNKNOWN_COMMAND", 15, 0, 
-                   (struct sockaddr*)&client_addr, client_len);
         }
+    }
+    return NULL;
+}
 
-        update_facture();
-        pthread_mutex_unlock(&mutex);
+// Relève la limite de descripteurs pour tenir des milliers de connexions
+void raise_fd_limit() {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
     }
 }
 
@@ -297,7 +4569,7 @@ void* agency_handler(void* arg) {
     struct sockaddr_in server_addr;
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(8080);
+    server_addr.sin_port = htons(listen_port);
 
     if (strcmp(protocol, "tcp") == 0) {
         agency_sock = socket(AF_INET, SOCK_STREAM, 0);
@@ -305,57 +4577,211 @@ void* agency_handler(void* arg) {
             perror("Erreur lors de la création du socket TCP");
             exit(EXIT_FAILURE);
         }
+        int opt = 1;
+        setsockopt(agency_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
         if (bind(agency_sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
             perror("Erreur lors du bind TCP");
             exit(EXIT_FAILURE);
         }
-        if (listen(agency_sock, 10) < 0) {
+        if (listen(agency_sock, SOMAXCONN) < 0) {
             perror("Erreur lors du listen TCP");
             exit(EXIT_FAILURE);
         }
-        printf("Serveur agence (TCP) démarré sur le port 8080\n");
-
-        while (1) {
-            struct sockaddr_in client_addr;
-            socklen_t client_len = sizeof(client_addr);
-            int* client_sock = malloc(sizeof(int));
-            *client_sock = accept(agency_sock, (struct sockaddr*)&client_addr, &client_len);
-            if (*client_sock < 0) {
-                perror("Erreur lors de l'acceptation");
-                free(client_sock);
-                continue;
+        raise_fd_limit();
+        listen_sock = agency_sock;
+        if (use_uring) {
+            start_notifier();
+            printf("Serveur agence (TCP, io_uring) démarré sur le port %d (%d threads)\n",
+                   listen_port, num_workers);
+            pthread_t workers[num_workers];
+            for (int i = 0; i < num_workers; i++) {
+                if (pthread_create(&workers[i], NULL, uring_worker, NULL) != 0) {
+                    perror("Erreur lors de la création du thread");
+                    exit(EXIT_FAILURE);
+                }
             }
+            for (int i = 0; i < num_workers; i++) {
+                pthread_join(workers[i], NULL);
+            }
+            close(agency_sock);
+            return NULL;
+        }
+        if (set_nonblocking(agency_sock) < 0) {
+            perror("Erreur lors du passage en mode non bloquant");
+            exit(EXIT_FAILURE);
+        }
+
+        epoll_fd = epoll_create1(0);
+        if (epoll_fd < 0) {
+            perror("Erreur lors de la création de l'instance epoll");
+            exit(EXIT_FAILURE);
+        }
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
+        ev.data.ptr = NULL; // NULL identifie le socket d'écoute
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_sock, &ev) < 0) {
+            perror("Erreur lors de l'ajout du socket d'écoute à epoll");
+            exit(EXIT_FAILURE);
+        }
+        start_notifier();
+        printf("Serveur agence (TCP) démarré sur le port %d (%d threads)\n", listen_port,
+               num_workers);
 
-            pthread_t thread;
-            if (pthread_create(&thread, NULL, handle_client, client_sock) != 0) {
+        // Pool fixe de threads partageant la même instance epoll
+        pthread_t workers[num_workers];
+        for (int i = 0; i < num_workers; i++) {
+            if (pthread_create(&workers[i], NULL, tcp_worker, NULL) != 0) {
                 perror("Erreur lors de la création du thread");
-                close(*client_sock);
-                free(client_sock);
-            } else {
-                pthread_detach(thread);
+                exit(EXIT_FAILURE);
             }
         }
+        for (int i = 0; i < num_workers; i++) {
+            pthread_join(workers[i], NULL);
+        }
+        close(agency_sock);
     } else { // udp
-        agency_sock = socket(AF_INET, SOCK_DGRAM, 0);
-        if (agency_sock < 0) {
-            perror("Erreur lors de la création du socket UDP");
-            exit(EXIT_FAILURE);
+        printf("Serveur agence (UDP) démarré sur le port %d (%d threads)\n", listen_port,
+               num_workers);
+        pthread_t workers[num_workers];
+        for (int i = 0; i < num_workers; i++) {
+            if (pthread_create(&workers[i], NULL, udp_worker, &server_addr) != 0) {
+                perror("Erreur lors de la création du thread");
+                exit(EXIT_FAILURE);
+            }
         }
-        if (bind(agency_sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-            perror("Erreur lors du bind UDP");
-            exit(EXIT_FAILURE);
+        for (int i = 0; i < num_workers; i++) {
+            pthread_join(workers[i], NULL);
         }
-        printf("Serveur agence (UDP) démarré sur le port 8080\n");
-        handle_agency_udp(agency_sock);
     }
-    close(agency_sock);
     return NULL;
 }
 
-int main() {
+// Affiche le journal non compacté dans l'ordre, jusqu'à la dernière ligne
+// indexée (les transactions archivées sont résumées dans histo.agg)
+void history_print() {
+    uint64_t end = __atomic_load_n(&history.end_lsn, __ATOMIC_ACQUIRE);
+    uint64_t compacted = __atomic_load_n(&aggregates.lsn, __ATOMIC_ACQUIRE);
+    if (compacted > 0) {
+        printf("Transactions jusqu'à l'octet %llu compactées: histo.agg, détail dans archive/\n",
+               (unsigned long long)compacted);
+    }
+    char data[65536];
+    for (uint64_t pos = compacted; pos < end;) {
+        size_t size = end - pos < sizeof(data) ? end - pos : sizeof(data);
+        ssize_t n = journal_pread(data, size, pos);
+        if (n <= 0) break;
+        fwrite(data, 1, n, stdout);
+        pos += n;
+    }
+}
+
+// Affiche toutes les pages d'une requête, de la plus récente à la plus ancienne
+void history_print_query(int kind, long long key, long long to) {
+    Buffer page = {0};
+    uint32_t cursor = 0;
+    int lines = 0;
+    do {
+        cursor = history_query(kind, key, to, cursor, HISTORY_PAGE_MAX, &page);
+        for (size_t i = 0; i < page.len; i++) lines += page.data[i] == '\n';
+        fwrite(page.data, 1, page.len, stdout);
+        page.len = 0;
+    } while (cursor > 0);
+    buffer_free(&page);
+    printf("%d transaction(s)\n", lines);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "w:s:c:f:m:buq:r:p:J:R:j:")) != -1) {
+        if (opt == 'w' && atoi(optarg) > 0) {
+            num_workers = atoi(optarg);
+        } else if (opt == 's' && atoi(optarg) >= 0) {
+            sync_interval_ms = atoi(optarg);
+        } else if (opt == 'c' && atoi(optarg) >= 0) {
+            checkpoint_interval = atoi(optarg);
+        } else if (opt == 'f' && atoi(optarg) > 0) {
+            flush_interval_ms = atoi(optarg);
+        } else if (opt == 'm' && atoi(optarg) >= 0) {
+            stats_interval = atoi(optarg);
+        } else if (opt == 'b') {
+            use_vols_bin = 1;
+        } else if (opt == 'u') {
+            use_uring = 1;
+        } else if (opt == 'q' && atoi(optarg) >= 0) {
+            max_queue = atoi(optarg);
+        } else if (opt == 'r' && atoi(optarg) >= 0) {
+            agency_rate = atoi(optarg);
+        } else if (opt == 'p' && atoi(optarg) > 0 && atoi(optarg) < 65536) {
+            listen_port = atoi(optarg);
+        } else if (opt == 'J' && atoi(optarg) > 0 && atoi(optarg) < 65536) {
+            replication_port = atoi(optarg);
+        } else if (opt == 'R' && strchr(optarg, ':')) {
+            primary_address = optarg;
+        } else if (opt == 'j' && atoll(optarg) >= 0) {
+            segment_size = atoll(optarg) * 1024;
+        } else {
+            printf("Usage: %s [-w nb_threads] [-s ms_entre_fdatasync (0: chaque lot)]"
+                   " [-c s_entre_points_de_reprise (0: aucun)]"
+                   " [-f ms_entre_ecritures_vols_facture]"
+                   " [-m s_entre_ecritures_stats (0: aucune)]"
+                   " [-b (vols.bin au lieu de vols.txt)]"
+                   " [-u (io_uring)]"
+                   " [-q requetes_en_attente_avant_BUSY (0: aucune limite)]"
+                   " [-r requetes_par_seconde_par_agence (0: aucune limite)]"
+                   " [-p port (8080)] [-J port_de_replication (aucun)]"
+                   " [-R hote_primaire:port_de_replication (réplique en lecture)]"
+                   " [-j Ko_par_segment_de_histo.txt (0: pas de rotation)]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (primary_address) resolve_primary();
+    if (use_uring && !uring_supported()) {
+        printf("io_uring indisponible: epoll et écritures classiques\n");
+        use_uring = 0;
+    }
+
     // Initialisation
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
     load_flights();
-    replay_history();
+    build_search_indexes();
+    load_aggregates();
+    segments_open();
+    uint64_t checkpoint_lsn;
+    int from_checkpoint = load_checkpoint(&checkpoint_lsn);
+    if (from_checkpoint) {
+        replay_history(checkpoint_lsn, checkpoint_lsn);
+    } else {
+        replay_aggregates();
+        replay_history(aggregates.lsn, vols_lsn);
+    }
+    if (primary_address) replica_catch_up(from_checkpoint ? checkpoint_lsn : vols_lsn);
+    history_open();
+    journal_open();
+    start_holds();
+    // Les versions reprennent au-delà de toutes celles attribuées avant le
+    // redémarrage (version.txt; la taille du journal pour un répertoire qui
+    // n'en a pas encore): un client peut garder la sienne. Les vols chargés
+    // portent tous cette version: un CONSULT_SINCE d'avant le redémarrage
+    // les reçoit tous, blocages perdus compris.
+    uint64_t version_base = load_version_base();
+    if (version_base < journal.appended_lsn) version_base = journal.appended_lsn;
+    next_version = version_low_water = version_base;
+    reserve_versions();
+    for (int i = 0; i < num_flights; i++) {
+        flight_versions[i] = next_version;
+    }
+    start_persistence();
+    start_compaction();
+    if (primary_address) start_replica();
+    if (replication_port > 0) start_replication();
+    if (stats_interval > 0) {
+        pthread_t stats;
+        if (pthread_create(&stats, NULL, stats_thread, NULL) != 0) {
+            perror("Erreur lors de la création du thread statistiques");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(stats);
+    }
 
     // Choix du protocole
     printf("Choisissez le protocole pour les agences (tcp/udp): ");
@@ -380,51 +4806,56 @@ int main() {
     while (1) {
         printf("Admin> ");
         char command[100];
-        fgets(command, sizeof(command), stdin);
+        if (!fgets(command, sizeof(command), stdin)) {
+            strcpy(command, "exit"); // Entrée standard fermée: arrêt propre
+        }
         command[strcspn(command, "\n")] = 0;
 
-        pthread_mutex_lock(&mutex);
-        
         if (strncmp(command, "flight ", 7) == 0) {
-            int ref;
+            int ref = 0;
             sscanf(command + 7, "%d", &ref);
-            int found = 0;
-            for (int i = 0; i < num_flights; i++) {
-                if (flights[i].ref == ref) {
-                    printf("Vol %d: %s, %d places, %d€/place\n",
-                           ref, flights[i].destination, flights[i].available_seats, 
-                           flights[i].price);
-                    found = 1;
-                    break;
-                }
+            int i = find_flight_index(ref);
+            if (i != -1) {
+                printf("Vol %d: %s, %d places, %d€/place\n",
+                       ref, flights[i].destination, get_seats(&flights[i]),
+                       flights[i].price);
+            } else {
+                printf("Vol %d non trouvé\n", ref);
             }
-            if (!found) printf("Vol %d non trouvé\n", ref);
         } else if (strncmp(command, "invoice ", 8) == 0) {
             int agency_id;
             sscanf(command + 8, "%d", &agency_id);
-            printf("Facture agence %d: %.2f€\n", agency_id, total_payments[agency_id]);
+            printf("Facture agence %d: %.2f€\n", agency_id, get_payment(agency_id));
         } else if (strcmp(command, "history") == 0) {
-            FILE *fp = fopen("histo.txt", "r");
-            if (fp) {
-                char line[256];
-                while (fgets(line, sizeof(line), fp)) {
-                    printf("%s", line);
-                }
-                fclose(fp);
+            history_print();
+        } else if (strncmp(command, "history ", 8) == 0) {
+            char kind_name[16] = "";
+            long long key = 0, to = 0;
+            int parsed = sscanf(command + 8, "%15s %lld %lld", kind_name, &key, &to);
+            if (strcmp(kind_name, "agency") == 0 && parsed >= 2) {
+                history_print_query(HISTORY_AGENCY, key, 0);
+            } else if (strcmp(kind_name, "flight") == 0 && parsed >= 2) {
+                history_print_query(HISTORY_FLIGHT, key, 0);
+            } else if (strcmp(kind_name, "time") == 0 && parsed == 3) {
+                history_print_query(HISTORY_TIME, key, to);
             } else {
-                printf("Historique non trouvé\n");
+                printf("Usage: history [agency <id> | flight <ref> | time <début> <fin>]\n");
             }
+        } else if (strcmp(command, "stats") == 0) {
+            Buffer report = {0};
+            stats_report(&report);
+            printf("%s", report.data ? report.data : "");
+            buffer_free(&report);
         } else if (strcmp(command, "exit") == 0) {
-            pthread_mutex_unlock(&mutex);
+            journal_flush();
+            persist(1);
             printf("Arrêt du serveur\n");
             exit(0);
         } else {
-            printf("Commande inconnue. Options: flight <ref>, invoice <agency_id>, history, exit\n");
+            printf("Commande inconnue. Options: flight <ref>, invoice <agency_id>, history"
+                   " [agency <id> | flight <ref> | time <début> <fin>], stats, exit\n");
         }
-        
-        pthread_mutex_unlock(&mutex);
     }
 
-    pthread_mutex_destroy(&mutex);
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,150 @@
+// Conversion entre vols.txt et vols.bin (format binaire du serveur, option -b)
+#include "volsbin.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    VolsBinRecord *records;
+    size_t count;
+    size_t capacity;
+} RecordTable;
+
+int compare_refs(const void *a, const void *b) {
+    const VolsBinRecord *x = *(const VolsBinRecord * const *)a;
+    const VolsBinRecord *y = *(const VolsBinRecord * const *)b;
+    if (x->ref != y->ref) return (x->ref > y->ref) - (x->ref < y->ref);
+    return (x > y) - (x < y); // À référence égale, la première ligne d'abord
+}
+
+// Retire les vols en double (le serveur garde la première occurrence)
+void remove_duplicates(RecordTable *table) {
+    if (table->count == 0) return;
+    VolsBinRecord **order = malloc(table->count * sizeof(VolsBinRecord *));
+    char *duplicate = calloc(table->count, 1);
+    if (!order || !duplicate) {
+        perror("Erreur d'allocation");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < table->count; i++) order[i] = &table->records[i];
+    qsort(order, table->count, sizeof(VolsBinRecord *), compare_refs);
+    for (size_t i = 1; i < table->count; i++) {
+        if (order[i]->ref == order[i - 1]->ref) {
+            printf("Vol %d en double, ignoré\n", order[i]->ref);
+            duplicate[order[i] - table->records] = 1;
+        }
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < table->count; i++) {
+        if (!duplicate[i]) table->records[kept++] = table->records[i];
+    }
+    table->count = kept;
+    free(order);
+    free(duplicate);
+}
+
+// vols.txt -> vols.bin
+void import_flights(const char *text_path, const char *bin_path) {
+    FILE *in = fopen(text_path, "r");
+    if (!in) {
+        perror("Erreur lors de l'ouverture du fichier texte");
+        exit(EXIT_FAILURE);
+    }
+    RecordTable table = {0};
+    unsigned long long lsn = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), in)) {
+        if (sscanf(line, "# histo.txt %llu", &lsn) == 1) continue;
+        VolsBinRecord record;
+        memset(&record, 0, sizeof(record));
+        if (sscanf(line, "%d %49s %d %d", &record.ref, record.destination,
+                   &record.seats[0], &record.price) != 4) {
+            continue; // Ligne vide ou mal formée
+        }
+        record.seats[1] = record.seats[0];
+        if (table.count == table.capacity) {
+            table.capacity = table.capacity ? table.capacity * 2 : 1024;
+            table.records = realloc(table.records, table.capacity * sizeof(VolsBinRecord));
+            if (!table.records) {
+                perror("Erreur d'allocation");
+                exit(EXIT_FAILURE);
+            }
+        }
+        table.records[table.count++] = record;
+    }
+    fclose(in);
+    remove_duplicates(&table);
+
+    VolsBinHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, VOLSBIN_MAGIC, sizeof(header.magic));
+    header.record_size = sizeof(VolsBinRecord);
+    header.count = table.count;
+    header.lsn[0] = header.lsn[1] = lsn;
+
+    char tmp_path[512];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", bin_path);
+    FILE *out = fopen(tmp_path, "wb");
+    if (!out || fwrite(&header, sizeof(header), 1, out) != 1 ||
+        fwrite(table.records, sizeof(VolsBinRecord), table.count, out) != table.count ||
+        fclose(out) != 0 || rename(tmp_path, bin_path) < 0) {
+        perror("Erreur lors de l'écriture du fichier binaire");
+        exit(EXIT_FAILURE);
+    }
+    printf("%zu vols importés dans %s\n", table.count, bin_path);
+    free(table.records);
+}
+
+// vols.bin -> vols.txt (jeu de places actif)
+void export_flights(const char *bin_path, const char *text_path) {
+    FILE *in = fopen(bin_path, "rb");
+    VolsBinHeader header;
+    if (!in || fread(&header, sizeof(header), 1, in) != 1) {
+        perror("Erreur lors de la lecture du fichier binaire");
+        exit(EXIT_FAILURE);
+    }
+    if (memcmp(header.magic, VOLSBIN_MAGIC, sizeof(header.magic)) != 0 ||
+        header.record_size != sizeof(VolsBinRecord) || header.active > 1) {
+        fprintf(stderr, "%s n'est pas un fichier de vols binaire valide\n", bin_path);
+        exit(EXIT_FAILURE);
+    }
+    FILE *out = fopen(text_path, "w");
+    if (!out) {
+        perror("Erreur lors de l'ouverture du fichier texte");
+        exit(EXIT_FAILURE);
+    }
+    fprintf(out, "# histo.txt %llu\n", (unsigned long long)header.lsn[header.active]);
+    VolsBinRecord record;
+    uint64_t count = 0;
+    while (count < header.count && fread(&record, sizeof(record), 1, in) == 1) {
+        record.destination[VOLSBIN_DEST_SIZE - 1] = '\0';
+        fprintf(out, "%d %s %d %d\n", record.ref, record.destination,
+                record.seats[header.active], record.price);
+        count++;
+    }
+    fclose(in);
+    if (fclose(out) != 0) {
+        perror("Erreur lors de l'écriture du fichier texte");
+        exit(EXIT_FAILURE);
+    }
+    if (count != header.count) {
+        fprintf(stderr, "%s tronqué: %llu vols sur %llu\n", bin_path,
+                (unsigned long long)count, (unsigned long long)header.count);
+        exit(EXIT_FAILURE);
+    }
+    printf("%llu vols exportés dans %s\n", (unsigned long long)count, text_path);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc >= 2 && argc <= 4 && strcmp(argv[1], "import") == 0) {
+        import_flights(argc > 2 ? argv[2] : "vols.txt", argc > 3 ? argv[3] : "vols.bin");
+    } else if (argc >= 2 && argc <= 4 && strcmp(argv[1], "export") == 0) {
+        export_flights(argc > 2 ? argv[2] : "vols.bin", argc > 3 ? argv[3] : "vols.txt");
+    } else {
+        printf("Usage: %s import [vols.txt] [vols.bin]\n", argv[0]);
+        printf("       %s export [vols.bin] [vols.txt]\n", argv[0]);
+        printf("(serveur arrêté: il modifie vols.bin sur place)\n");
+        exit(EXIT_FAILURE);
+    }
+    return 0;
+}
@@ -0,0 +1,39 @@
+// Format binaire de la table des vols (vols.bin), alternative à vols.txt
+#ifndef VOLSBIN_H
+#define VOLSBIN_H
+
+#include <stdint.h>
+
+// Le fichier est un en-tête suivi d'un enregistrement de taille fixe par
+// vol, dans l'ordre de la table du serveur. Il est projeté en mémoire et
+// modifié sur place: une modification de places ne touche que la page de
+// l'enregistrement concerné.
+//
+// Chaque enregistrement garde deux jeux de places. Le serveur écrit dans le
+// jeu inactif, synchronise, puis bascule active dans l'en-tête: une panne
+// au milieu d'une mise à jour laisse toujours le jeu actif intact, cohérent
+// avec sa position lsn[active] dans histo.txt. Entiers dans l'ordre natif
+// de la machine.
+#define VOLSBIN_MAGIC "VOLSBIN1"
+#define VOLSBIN_DEST_SIZE 64
+
+typedef struct {
+    char magic[8];
+    uint32_t record_size;  // sizeof(VolsBinRecord), contrôlé au chargement
+    uint32_t active;       // Jeu de places valide (0 ou 1)
+    uint64_t count;        // Nombre d'enregistrements
+    uint64_t lsn[2];       // Position de histo.txt reflétée par chaque jeu
+    char reserved[24];
+} VolsBinHeader;
+
+typedef struct {
+    int32_t ref;
+    int32_t price;
+    int32_t seats[2];
+    char destination[VOLSBIN_DEST_SIZE];
+} VolsBinRecord;
+
+_Static_assert(sizeof(VolsBinHeader) == 64, "en-tête de vols.bin");
+_Static_assert(sizeof(VolsBinRecord) == 80, "enregistrement de vols.bin");
+
+#endif